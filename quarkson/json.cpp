@@ -1,6 +1,10 @@
 #include <type_traits>
 
 #include <cassert>
+#include <mutex>
+#include <algorithm>
+#include <atomic>
+#include <unordered_set>
 
 #include "json.hpp"
 
@@ -20,6 +24,7 @@ public:
 class json_object : public json_value
 {
 	friend json_value;
+	friend interner;
 public:
 	explicit json_object(const json::object& obj) : obj_(obj) {};
 	explicit json_object(json::object&& obj) : obj_(std::move(obj)) {};
@@ -32,9 +37,42 @@ private:
 	json::object obj_;
 };
 
+// An object whose member names live in a shared shape; it holds only the
+// values, in slot order.
+class json_shaped_object : public json_value
+{
+	friend json_value;
+	friend interner;
+public:
+	json_shaped_object(shared_ptr<const object_shape>&& shape, json::array&& values) : shape_(std::move(shape)), values_(std::move(values)) {}
+
+	virtual const json::json_type type() const { return json::json_type::OBJECT; }
+
+	virtual const shared_ptr<json_value> get() { return shared_ptr<json_value>(this); }
+
+private:
+	const json::object & materialized() const
+	{
+		std::call_once(obj_once_, [this]
+		{
+			obj_.reset(new json::object());
+			obj_->reserve(values_.size());
+			for (size_t i = 0; i < values_.size(); ++i)
+				obj_->emplace(shape_->keys()[i], values_[i]);
+		});
+		return *obj_;
+	}
+
+	shared_ptr<const object_shape> shape_;
+	json::array values_;
+	mutable std::once_flag obj_once_;
+	mutable std::unique_ptr<json::object> obj_;
+};
+
 class json_array : public json_value
 {
 	friend json_value;
+	friend interner;
 public:
 	explicit json_array(const json::array& arr) : arr_(arr) {};
 	explicit json_array(json::array&& arr) : arr_(std::move(arr)) {};
@@ -47,9 +85,42 @@ private:
 	json::array arr_;
 };
 
+// An array whose elements are all numbers, kept as one buffer of doubles
+// instead of a node per element.
+class json_number_array : public json_value
+{
+	friend json_value;
+	friend interner;
+public:
+	explicit json_number_array(vector<double>&& nums) : nums_(std::move(nums)) {};
+
+	virtual const json::json_type type() const { return json::json_type::ARRAY; }
+
+	virtual const shared_ptr<json_value> get() { return shared_ptr<json_value>(this); }
+
+private:
+	// Boxed copies of the elements for callers that want a json::array,
+	// built on first use.
+	const json::array & boxed() const
+	{
+		std::call_once(boxed_once_, [this]
+		{
+			boxed_.reserve(nums_.size());
+			for (double num : nums_)
+				boxed_.push_back(number_instance(num));
+		});
+		return boxed_;
+	}
+
+	vector<double> nums_;
+	mutable std::once_flag boxed_once_;
+	mutable json::array boxed_;
+};
+
 class json_string : public json_value
 {
 	friend json_value;
+	friend interner;
 public:
 	explicit json_string(const string & str) : str_(str) {}
 	explicit json_string(string && str) : str_(std::move(str)) {}
@@ -100,16 +171,83 @@ public:
 
 const json::object & json_value::get_object() const
 {
+	if (const json_shaped_object *shaped = dynamic_cast<const json_shaped_object *>(this))
+		return shaped->materialized();
 	assert(dynamic_cast<const json_object *>(this) != nullptr);
 	return dynamic_cast<const json_object *>(this)->obj_;
 }
 
+const shared_ptr<json_value> & json_value::find(const json::key &k) const
+{
+	static const shared_ptr<json_value> none;
+
+	if (const json_shaped_object *shaped = dynamic_cast<const json_shaped_object *>(this))
+	{
+		// The cache holds the shape id above the low 24 bits and the slot,
+		// or SLOT_NONE for a missing member, in them.
+		const uint64_t SLOT_BITS = 24, SLOT_NONE = (uint64_t(1) << SLOT_BITS) - 1;
+		const object_shape &shape = *shaped->shape_;
+		std::atomic_ref<uint64_t> cache(k.cache_);
+		uint64_t c = cache.load(std::memory_order_relaxed);
+		uint64_t slot;
+		if ((c >> SLOT_BITS) == shape.id())
+			slot = c & SLOT_NONE;
+		else
+		{
+			size_t found = shape.slot(k);
+			slot = found == object_shape::npos ? SLOT_NONE : found;
+			if (slot <= SLOT_NONE && shape.id() < (uint64_t(1) << (64 - SLOT_BITS)))
+				cache.store(shape.id() << SLOT_BITS | slot, std::memory_order_relaxed);
+		}
+		return slot >= shaped->values_.size() ? none : shaped->values_[static_cast<size_t>(slot)];
+	}
+
+	const json::object &obj = get_object();
+	auto it = obj.find(k);
+	return it == obj.end() ? none : it->second;
+}
+
+const object_shape * json_value::shape() const
+{
+	const json_shaped_object *shaped = dynamic_cast<const json_shaped_object *>(this);
+	return shaped ? shaped->shape_.get() : nullptr;
+}
+
+std::span<const shared_ptr<json_value>> json_value::get_values() const
+{
+	const json_shaped_object *shaped = dynamic_cast<const json_shaped_object *>(this);
+	return shaped ? std::span<const shared_ptr<json_value>>(shaped->values_) : std::span<const shared_ptr<json_value>>();
+}
+
+object_shape::object_shape(vector<string> keys) : keys_(std::move(keys))
+{
+	static std::atomic<uint64_t> next_id(1);
+	id_ = next_id.fetch_add(1, std::memory_order_relaxed);
+
+	slots_.reserve(keys_.size());
+	for (size_t i = 0; i < keys_.size(); ++i)
+		slots_.emplace(keys_[i], i);
+}
+
 const json::array & json_value::get_array() const
 {
+	if (const json_number_array *packed = dynamic_cast<const json_number_array *>(this))
+		return packed->boxed();
 	assert(dynamic_cast<const json_array *>(this) != nullptr);
 	return dynamic_cast<const json_array *>(this)->arr_;
 }
 
+std::span<const double> json_value::get_numbers() const
+{
+	const json_number_array *packed = dynamic_cast<const json_number_array *>(this);
+	return packed ? std::span<const double>(packed->nums_) : std::span<const double>();
+}
+
+bool json_value::is_packed() const
+{
+	return dynamic_cast<const json_number_array *>(this) != nullptr;
+}
+
 const string & json_value::get_string() const
 {
 	assert(dynamic_cast<const json_string *>(this) != nullptr);
@@ -161,7 +299,7 @@ shared_ptr<json_value> json_value::string_instance(const string &str)
 
 shared_ptr<json_value> json_value::string_instance(string &&str)
 {
-	return (new json_string(str))->get();
+	return (new json_string(std::move(str)))->get();
 }
 
 shared_ptr<json_value> json_value::array_instance(const json::array &arr)
@@ -171,7 +309,12 @@ shared_ptr<json_value> json_value::array_instance(const json::array &arr)
 
 shared_ptr<json_value> json_value::array_instance(json::array &&arr)
 {
-	return (new json_array(arr))->get();
+	return (new json_array(std::move(arr)))->get();
+}
+
+shared_ptr<json_value> json_value::array_instance(vector<double> &&nums)
+{
+	return (new json_number_array(std::move(nums)))->get();
 }
 
 shared_ptr<json_value> json_value::object_instance(const json::object &obj)
@@ -181,7 +324,13 @@ shared_ptr<json_value> json_value::object_instance(const json::object &obj)
 
 shared_ptr<json_value> json_value::object_instance(json::object &&obj)
 {
-	return (new json_object(obj))->get();
+	return (new json_object(std::move(obj)))->get();
+}
+
+shared_ptr<json_value> json_value::object_instance(shared_ptr<const object_shape> shape, json::array &&values)
+{
+	assert(shape->keys().size() == values.size());
+	return (new json_shaped_object(std::move(shape), std::move(values)))->get();
 }
 
 const json::json_type json::type() const
@@ -194,11 +343,36 @@ const json::object & json::get_object() const
 	return data_->get_object();
 }
 
+const shared_ptr<json_value> & json::find(const key &k) const
+{
+	return data_->find(k);
+}
+
+const object_shape * json::shape() const
+{
+	return data_->shape();
+}
+
+std::span<const shared_ptr<json_value>> json::get_values() const
+{
+	return data_->get_values();
+}
+
 const json::array & json::get_array() const
 {
 	return data_->get_array();
 }
 
+std::span<const double> json::get_numbers() const
+{
+	return data_->get_numbers();
+}
+
+bool json::is_packed() const
+{
+	return data_->is_packed();
+}
+
 double json::get_number() const
 {
 	return data_->get_number();
@@ -219,6 +393,281 @@ nullptr_t json::get_null() const
 	return data_->get_null();
 }
 
+compact_stats json::compact()
+{
+	interner in;
+	return compact(in);
+}
+
+compact_stats json::compact(interner &in)
+{
+	compact_stats before = in.stats();
+	in.compact(data_);
+	compact_stats after = in.stats();
+	after.nodes_shared -= before.nodes_shared;
+	after.bytes_saved -= before.bytes_saved;
+	return after;
+}
+
+namespace {
+
+// Rough heap footprint of a node without its children: the node, the
+// control block of its shared_ptr and the buffers it owns.
+size_t footprint(const json_value &v)
+{
+	const size_t control_block = 3 * sizeof(void *);
+	const size_t sso = string().capacity();
+
+	switch (v.type())
+	{
+	case json::json_type::STRING:
+	{
+		size_t cap = v.get_string().capacity();
+		return sizeof(json_string) + control_block + (cap > sso ? cap + 1 : 0);
+	}
+	case json::json_type::ARRAY:
+		if (v.is_packed())
+			return sizeof(json_number_array) + control_block + v.get_numbers().size() * sizeof(double);
+		return sizeof(json_array) + control_block + v.get_array().capacity() * sizeof(shared_ptr<json_value>);
+	case json::json_type::OBJECT:
+	{
+		if (const object_shape *shape = v.shape())
+			return sizeof(json_shaped_object) + control_block + shape->keys().size() * sizeof(shared_ptr<json_value>);
+		const json::object &obj = v.get_object();
+		size_t n = sizeof(json_object) + control_block + obj.bucket_count() * sizeof(void *);
+		for (const auto &kv : obj)
+			n += sizeof(void *) + sizeof(size_t) + sizeof(kv) + (kv.first.capacity() > sso ? kv.first.capacity() + 1 : 0);
+		return n;
+	}
+	case json::json_type::NUMBER:
+		return sizeof(json_number) + control_block;
+	case json::json_type::BOOLEAN:
+		return sizeof(json_boolean) + control_block;
+	default:
+		return sizeof(json_null) + control_block;
+	}
+}
+
+}
+
+size_t json::memory_usage() const
+{
+	size_t n = 0;
+	// Only nodes with other owners can be met twice.
+	std::unordered_set<const json_value *> shared;
+	vector<const shared_ptr<json_value> *> stack{ &data_ };
+	while (!stack.empty())
+	{
+		const shared_ptr<json_value> &v = *stack.back();
+		stack.pop_back();
+		if (v.use_count() > 1 && !shared.insert(v.get()).second)
+			continue;
+		n += footprint(*v);
+		if (v->type() == json_type::ARRAY && !v->is_packed())
+			for (const auto &e : v->get_array())
+				stack.push_back(&e);
+		else if (v->type() == json_type::OBJECT && v->shape())
+			for (const auto &e : v->get_values())
+				stack.push_back(&e);
+		else if (v->type() == json_type::OBJECT)
+			for (const auto &kv : v->get_object())
+				stack.push_back(&kv.second);
+	}
+	return n;
+}
+
+size_t interner::container_hash::operator()(const container_key &k) const
+{
+	size_t h = static_cast<size_t>(k.type);
+	for (const auto &c : k.children)
+	{
+		h = h * 1099511628211ULL ^ json::key::hash_bytes(c.first);
+		h = h * 1099511628211ULL ^ std::hash<const json_value *>()(c.second);
+	}
+	return h;
+}
+
+shared_ptr<json_value> interner::share(const shared_ptr<json_value> &found, const shared_ptr<json_value> &v)
+{
+	if (found != v)
+	{
+		++stats_.nodes_shared;
+		stats_.bytes_saved += footprint(*v);
+	}
+	return found;
+}
+
+shared_ptr<json_value> interner::intern(shared_ptr<json_value> v)
+{
+	switch (v->type())
+	{
+	case json::json_type::STRING:
+	{
+		// Keyed by a view of the first node's own string, which the table
+		// keeps alive.
+		auto it = strings_.find(v->get_string());
+		if (it != strings_.end())
+			return share(it->second, v);
+		strings_.emplace(v->get_string(), v);
+		return v;
+	}
+	case json::json_type::NUMBER:
+	{
+		double num = v->get_number();
+		uint64_t bits;
+		memcpy(&bits, &num, sizeof(bits));
+		auto it = numbers_.try_emplace(bits, v).first;
+		return share(it->second, v);
+	}
+	case json::json_type::BOOLEAN:
+	{
+		shared_ptr<json_value> &slot = v->get_bool() ? true_ : false_;
+		if (!slot)
+			slot = v;
+		return share(slot, v);
+	}
+	case json::json_type::NUL:
+		if (!null_)
+			null_ = v;
+		return share(null_, v);
+	case json::json_type::ARRAY:
+	case json::json_type::OBJECT:
+	{
+		if (v->is_packed())
+		{
+			std::span<const double> nums = v->get_numbers();
+			if (nums.size() > max_children_)
+				return v;
+			auto it = packed_.try_emplace(string(reinterpret_cast<const char *>(nums.data()), nums.size_bytes()), v).first;
+			return share(it->second, v);
+		}
+
+		container_key k;
+		k.type = v->type();
+		if (k.type == json::json_type::ARRAY)
+		{
+			const json::array &arr = v->get_array();
+			if (arr.size() > max_children_)
+				return v;
+			for (const auto &c : arr)
+				k.children.emplace_back(string_view(), c.get());
+		}
+		else if (const json_shaped_object *shaped = dynamic_cast<const json_shaped_object *>(v.get()))
+		{
+			// Read through the shape so the member map is never built.
+			if (shaped->values_.size() > max_children_)
+				return v;
+			for (size_t i = 0; i < shaped->values_.size(); ++i)
+				k.children.emplace_back(shaped->shape_->keys()[i], shaped->values_[i].get());
+			std::sort(k.children.begin(), k.children.end());
+		}
+		else
+		{
+			const json::object &obj = v->get_object();
+			if (obj.size() > max_children_)
+				return v;
+			for (const auto &kv : obj)
+				k.children.emplace_back(kv.first, kv.second.get());
+			std::sort(k.children.begin(), k.children.end());
+		}
+		auto it = containers_.try_emplace(std::move(k), v).first;
+		return share(it->second, v);
+	}
+	default:
+		return v;
+	}
+}
+
+void interner::compact(shared_ptr<json_value> &root)
+{
+	// Post-order walk over an explicit stack. The results of an item's
+	// children are at done[first, ...) once they are all finished; a
+	// container whose children changed is rebuilt, never modified.
+	struct item
+	{
+		shared_ptr<json_value> node;
+		size_t first;
+		bool expanded;
+	};
+	vector<item> stack;
+	vector<shared_ptr<json_value>> done;
+	// Results for containers held by more than their parent, so one met
+	// twice is rebuilt once. The old tree stays alive meanwhile, so
+	// addresses are not reused.
+	unordered_map<const json_value *, shared_ptr<json_value>> seen;
+	stack.push_back({ root, 0, false });
+	while (!stack.empty())
+	{
+		item &it = stack.back();
+		json_value *v = it.node.get();
+		// Held by the parent and by this item.
+		bool shared = it.node.use_count() > 2;
+		if (!it.expanded)
+		{
+			auto found = shared ? seen.find(v) : seen.end();
+			if (found != seen.end())
+			{
+				done.push_back(found->second);
+				stack.pop_back();
+				continue;
+			}
+			it.expanded = true;
+			it.first = done.size();
+			// Children finish last first, so their results come out
+			// reversed.
+			if (json_array *arr = dynamic_cast<json_array *>(v))
+				for (auto &c : arr->arr_)
+					stack.push_back({ c, 0, false });
+			else if (json_object *obj = dynamic_cast<json_object *>(v))
+				for (auto &kv : obj->obj_)
+					stack.push_back({ kv.second, 0, false });
+			else if (json_shaped_object *shaped = dynamic_cast<json_shaped_object *>(v))
+				for (auto &c : shaped->values_)
+					stack.push_back({ c, 0, false });
+			continue;
+		}
+
+		shared_ptr<json_value> node = std::move(it.node);
+		size_t first = it.first;
+		stack.pop_back();
+		auto results = done.begin() + first;
+		std::reverse(results, done.end());
+		if (json_array *arr = dynamic_cast<json_array *>(v))
+		{
+			if (!std::equal(arr->arr_.begin(), arr->arr_.end(), results))
+				node = json_value::array_instance(json::array(results, done.end()));
+		}
+		else if (json_object *obj = dynamic_cast<json_object *>(v))
+		{
+			bool same = true;
+			auto r = results;
+			for (auto &kv : obj->obj_)
+				same = same && kv.second == *r++;
+			if (!same)
+			{
+				json::object rebuilt;
+				rebuilt.reserve(obj->obj_.size());
+				r = results;
+				for (auto &kv : obj->obj_)
+					rebuilt.emplace(kv.first, *r++);
+				node = json_value::object_instance(std::move(rebuilt));
+			}
+		}
+		else if (json_shaped_object *shaped = dynamic_cast<json_shaped_object *>(v))
+		{
+			if (!std::equal(shaped->values_.begin(), shaped->values_.end(), results))
+				node = json_value::object_instance(shaped->shape_, json::array(results, done.end()));
+		}
+		done.erase(results, done.end());
+
+		node = intern(std::move(node));
+		if (shared && (v->type() == json::json_type::ARRAY || v->type() == json::json_type::OBJECT))
+			seen.emplace(v, node);
+		done.push_back(std::move(node));
+	}
+	root = std::move(done.back());
+}
+
 void json::convert_to_object_add(const object &obj)
 {
 	object tmp_obj = obj;
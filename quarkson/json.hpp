@@ -1,11 +1,16 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <vector>
+#include <span>
 #include <unordered_map>
 #include <memory>
+#include <cstdint>
+#include <cstring>
 
 using std::string;
+using std::string_view;
 using std::vector;
 using std::unordered_map;
 using std::shared_ptr;
@@ -13,12 +18,85 @@ using std::shared_ptr;
 namespace quarkson {
 
 class json_value;
+class interner;
+class object_shape;
+class generator;
+
+struct compact_stats
+{
+	// Nodes replaced by an equal node seen before.
+	size_t nodes_shared = 0;
+	// Estimated heap bytes of the replaced nodes.
+	size_t bytes_saved = 0;
+};
 
 class json
 {
 public:
+	// An object member name with its hash computed up front, at compile
+	// time for constexpr keys. Lookups through it skip rehashing the name.
+	// The key only views the name, so build it from a literal or from a
+	// string that outlives it.
+	class key
+	{
+	public:
+		constexpr key(string_view name) : name_(name), hash_(hash_bytes(name)) {}
+
+		constexpr string_view name() const { return name_; }
+		constexpr size_t hash() const { return hash_; }
+
+		// 64-bit FNV-1a, folded to size_t.
+		static constexpr size_t hash_bytes(string_view s)
+		{
+			uint64_t h = 14695981039346656037ULL;
+			for (char ch : s)
+			{
+				h ^= static_cast<unsigned char>(ch);
+				h *= 1099511628211ULL;
+			}
+			return static_cast<size_t>(h ^ (h >> 32));
+		}
+
+	private:
+		friend json_value;
+
+		string_view name_;
+		size_t hash_;
+		// Inline cache for shaped objects: the id of the last shape this key
+		// was looked up in and the member's slot there. Read and written
+		// atomically, so a key may be shared between threads.
+		alignas(8) mutable uint64_t cache_ = 0;
+	};
+
+	// Transparent so that object::find accepts a key, a string or a string
+	// literal without building a temporary string. Not noexcept on purpose:
+	// libstdc++ then caches each member's hash in its node and compares it
+	// before the name bytes.
+	struct key_hash
+	{
+		using is_transparent = void;
+
+		size_t operator()(string_view s) const { return key::hash_bytes(s); }
+		size_t operator()(const key &k) const { return k.hash(); }
+	};
+
+	struct key_equal
+	{
+		using is_transparent = void;
+
+		bool operator()(string_view a, string_view b) const { return a == b; }
+		bool operator()(const key &a, string_view b) const { return same(a.name(), b); }
+		bool operator()(string_view a, const key &b) const { return same(a, b.name()); }
+
+	private:
+		static bool same(string_view a, string_view b)
+		{
+			return a.size() == b.size() && (a.empty() || (a[0] == b[0] && memcmp(a.data(), b.data(), a.size()) == 0));
+		}
+	};
+
 	using array = vector<shared_ptr<json_value>>;
-	using object = unordered_map<string, shared_ptr<json_value>>;
+	using object = unordered_map<string, shared_ptr<json_value>, key_hash, key_equal>;
 
 	enum class json_type
 	{
@@ -41,7 +119,21 @@ public:
 
 	const object & get_object() const;
 
+	// Member of an object, or null if it has none by that name.
+	const shared_ptr<json_value> & find(const key &) const;
+
+	// Layout shared with other objects, or null for an ordinary object.
+	const object_shape * shape() const;
+	// Member values of a shaped object in shape order, empty for any other
+	// value.
+	std::span<const shared_ptr<json_value>> get_values() const;
+
 	const array & get_array() const;
+
+	// Elements of an array of numbers that was stored packed, empty for any
+	// other value. get_array() works on packed arrays too.
+	std::span<const double> get_numbers() const;
+	bool is_packed() const;
 	
 	double get_number() const;
 	
@@ -51,10 +143,24 @@ public:
 
 	nullptr_t get_null() const;
 
+	// Makes equal strings, numbers and literals, and equal containers of
+	// up to 16 children, share one node. Only this json is pointed at the
+	// compacted tree; copies sharing the old nodes keep them unchanged.
+	// Savings assume nothing else holds the replaced nodes. Pass an
+	// interner to share across documents.
+	compact_stats compact();
+	compact_stats compact(interner &);
+
+	// Estimated heap bytes held by the document, counting a node shared
+	// within it once.
+	size_t memory_usage() const;
+
 	void convert_to_object_add(const object &);
 	void convert_to_object_add(object&&);
 
 private:
+	friend generator;
+
 	const shared_ptr<json_value> get() const { return data_; }
 	shared_ptr<json_value> data_;
 };
@@ -71,8 +177,18 @@ public:
 
 	const json::object & get_object() const;
 
+	const shared_ptr<json_value> & find(const json::key &) const;
+
+	const object_shape * shape() const;
+
+	std::span<const shared_ptr<json_value>> get_values() const;
+
 	const json::array & get_array() const;
 
+	std::span<const double> get_numbers() const;
+
+	bool is_packed() const;
+
 	const string & get_string() const;
 
 	double get_number() const;
@@ -88,9 +204,87 @@ public:
 	static shared_ptr<json_value> string_instance(string &&);
 	static shared_ptr<json_value> array_instance(const json::array &);
 	static shared_ptr<json_value> array_instance(json::array&&);
+	static shared_ptr<json_value> array_instance(vector<double>&&);
 	static shared_ptr<json_value> object_instance(const json::object &);
 	static shared_ptr<json_value> object_instance(json::object&&);
+	// values[i] is the member named shape->keys()[i].
+	static shared_ptr<json_value> object_instance(shared_ptr<const object_shape>, json::array&&);
 	static shared_ptr<json_value> error_instance();
 };
 
+// The member names of a kind of object, in order, each mapped to its slot.
+// Objects built on a shape store only their values; get_object() on them
+// builds an ordinary member map on first use.
+class object_shape
+{
+public:
+	static const size_t npos = static_cast<size_t>(-1);
+
+	// The names must be distinct.
+	explicit object_shape(vector<string> keys);
+
+	object_shape(const object_shape &) = delete;
+	object_shape & operator=(const object_shape &) = delete;
+
+	// Unique among all shapes of the process; never 0.
+	uint64_t id() const { return id_; }
+	const vector<string> & keys() const { return keys_; }
+
+	size_t slot(const json::key &k) const
+	{
+		auto it = slots_.find(k);
+		return it == slots_.end() ? npos : it->second;
+	}
+
+private:
+	uint64_t id_;
+	vector<string> keys_;
+	unordered_map<string_view, size_t, json::key_hash, json::key_equal> slots_;
+};
+
+// Hash-consing table for immutable values. A container is matched by its
+// member names and the identity of its children, so children must be
+// interned before their parent.
+class interner
+{
+public:
+	explicit interner(size_t max_children = 16) : max_children_(max_children) {}
+
+	// The node equal to v seen first, or v itself if it is new or not
+	// shareable.
+	shared_ptr<json_value> intern(shared_ptr<json_value> v);
+
+	// Points root at an interned copy of its tree, built bottom up.
+	// Containers whose children change are rebuilt; no existing node is
+	// modified, so other holders of the old tree are unaffected.
+	void compact(shared_ptr<json_value> &root);
+
+	const compact_stats & stats() const { return stats_; }
+
+private:
+	struct container_key
+	{
+		json::json_type type;
+		// Objects sorted by name; arrays with empty names.
+		vector<std::pair<string_view, const json_value *>> children;
+
+		bool operator==(const container_key &) const = default;
+	};
+
+	struct container_hash
+	{
+		size_t operator()(const container_key &) const;
+	};
+
+	shared_ptr<json_value> share(const shared_ptr<json_value> &found, const shared_ptr<json_value> &v);
+
+	size_t max_children_;
+	unordered_map<string_view, shared_ptr<json_value>> strings_;
+	unordered_map<uint64_t, shared_ptr<json_value>> numbers_;
+	unordered_map<string, shared_ptr<json_value>> packed_;
+	unordered_map<container_key, shared_ptr<json_value>, container_hash> containers_;
+	shared_ptr<json_value> true_, false_, null_;
+	compact_stats stats_;
+};
+
 }
\ No newline at end of file
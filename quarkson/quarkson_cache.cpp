@@ -0,0 +1,156 @@
+#include "quarkson_cache.hpp"
+
+#include <bit>
+
+namespace quarkson {
+
+namespace {
+
+// Entries share their shapes unless the caller has a registry of its own.
+parse_options sharing(parse_options opts, shape_registry &shapes)
+{
+	if (opts.shapes && opts.shared_shapes == nullptr)
+		opts.shared_shapes = &shapes;
+	return opts;
+}
+
+}
+
+parse_cache::parse_cache(size_t max_bytes, const parse_options &opts) : max_bytes_(max_bytes), opts_(sharing(opts, shapes_)) {}
+
+json parse_cache::parse(const string &s)
+{
+	string err;
+	return parse(s, err);
+}
+
+json parse_cache::parse(const string &s, string &err)
+{
+	uint64_t h = hash(s);
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		auto it = index_.find(h);
+		if (it != index_.end() && it->second->text == s)
+		{
+			++stats_.hits;
+			lru_.splice(lru_.begin(), lru_, it->second);
+			return it->second->doc;
+		}
+		++stats_.misses;
+	}
+
+	// Parsed unlocked, so misses on other threads go on meanwhile. Blank
+	// text parses to no value at all, which is not worth caching.
+	parser p(s, opts_);
+	shared_ptr<json_value> v = p.parse_value();
+	if (!p.err.empty())
+	{
+		err = p.err + " at offset " + std::to_string(p.err_offset);
+		return json(json_value::error_instance());
+	}
+	if (!v)
+	{
+		err = "unexpected end of input at offset " + std::to_string(p.p - p.s);
+		return json(json_value::error_instance());
+	}
+	json doc(std::move(v));
+	size_t bytes = sizeof(entry) + s.size() + doc.memory_usage();
+	if (bytes > max_bytes_)
+		return doc;
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto it = index_.find(h);
+	if (it != index_.end())
+	{
+		// Another thread got there first, or other text has the same hash.
+		if (it->second->text == s)
+		{
+			lru_.splice(lru_.begin(), lru_, it->second);
+			return it->second->doc;
+		}
+		erase(it->second);
+		++stats_.evictions;
+	}
+	lru_.push_front({ h, s, doc, bytes });
+	index_.emplace(h, lru_.begin());
+	++stats_.entries;
+	stats_.bytes += bytes;
+	while (stats_.bytes > max_bytes_)
+	{
+		erase(std::prev(lru_.end()));
+		++stats_.evictions;
+	}
+	return doc;
+}
+
+cache_stats parse_cache::stats() const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return stats_;
+}
+
+void parse_cache::clear()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	lru_.clear();
+	index_.clear();
+	stats_.entries = 0;
+	stats_.bytes = 0;
+}
+
+void parse_cache::erase(std::list<entry>::iterator it)
+{
+	--stats_.entries;
+	stats_.bytes -= it->bytes;
+	index_.erase(it->hash);
+	lru_.erase(it);
+}
+
+// XXH64 with seed 0.
+uint64_t parse_cache::hash(string_view s)
+{
+	const uint64_t P1 = 0x9E3779B185EBCA87ULL, P2 = 0xC2B2AE3D27D4EB4FULL, P3 = 0x165667B19E3779F9ULL,
+		P4 = 0x85EBCA77C2B2AE63ULL, P5 = 0x27D4EB2F165667C5ULL;
+	auto read64 = [](const char *p) { uint64_t v; memcpy(&v, p, sizeof(v)); return v; };
+	auto read32 = [](const char *p) { uint32_t v; memcpy(&v, p, sizeof(v)); return v; };
+	auto round = [&](uint64_t acc, uint64_t in) { return std::rotl(acc + in * P2, 31) * P1; };
+	auto merge = [&](uint64_t acc, uint64_t v) { return (acc ^ round(0, v)) * P1 + P4; };
+
+	const char *p = s.data(), *e = p + s.size();
+	uint64_t h;
+	if (s.size() >= 32)
+	{
+		uint64_t v1 = P1 + P2, v2 = P2, v3 = 0, v4 = 0 - P1;
+		for (; e - p >= 32; p += 32)
+		{
+			v1 = round(v1, read64(p));
+			v2 = round(v2, read64(p + 8));
+			v3 = round(v3, read64(p + 16));
+			v4 = round(v4, read64(p + 24));
+		}
+		h = std::rotl(v1, 1) + std::rotl(v2, 7) + std::rotl(v3, 12) + std::rotl(v4, 18);
+		h = merge(merge(merge(merge(h, v1), v2), v3), v4);
+	}
+	else
+		h = P5;
+	h += s.size();
+
+	for (; e - p >= 8; p += 8)
+		h = std::rotl(h ^ round(0, read64(p)), 27) * P1 + P4;
+	if (e - p >= 4)
+	{
+		h = std::rotl(h ^ read32(p) * P1, 23) * P2 + P3;
+		p += 4;
+	}
+	for (; p != e; ++p)
+		h = std::rotl(h ^ static_cast<unsigned char>(*p) * P5, 11) * P1;
+
+	h ^= h >> 33;
+	h *= P2;
+	h ^= h >> 29;
+	h *= P3;
+	h ^= h >> 32;
+	return h;
+}
+
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "json.hpp"
+#include "quarkson_parser.hpp"
+
+#include <list>
+#include <mutex>
+
+namespace quarkson {
+
+struct cache_stats
+{
+	size_t hits = 0;
+	size_t misses = 0;
+	// Entries dropped to make room, or replaced by other text with the same
+	// hash.
+	size_t evictions = 0;
+	size_t entries = 0;
+	// Input text plus estimated DOM size of the entries.
+	size_t bytes = 0;
+};
+
+// Remembers the documents parsed from recent inputs, so that text seen
+// before costs a hash and a compare instead of a parse. Entries are keyed by
+// a 64-bit hash of the text and confirmed byte by byte; the least recently
+// used go once the entries exceed max_bytes. Safe to use from several
+// threads. A hit shares its DOM with every other caller that got it. No
+// node is ever changed: compact() and convert_to_object_add() build new
+// nodes and repoint only the json they are called on, so a caller may use
+// them on a hit without the cache or other callers seeing it.
+class parse_cache
+{
+public:
+	explicit parse_cache(size_t max_bytes, const parse_options &opts = parse_options());
+
+	parse_cache(const parse_cache &) = delete;
+	parse_cache & operator=(const parse_cache &) = delete;
+
+	// As parser::parse with the cache's options. Invalid input is not
+	// cached. With opts.shapes the entries share one shape_registry, so
+	// misses on several threads parse one at a time.
+	json parse(const string &s);
+	json parse(const string &s, string &err);
+
+	cache_stats stats() const;
+	void clear();
+
+	static uint64_t hash(string_view s);
+
+private:
+	struct entry
+	{
+		uint64_t hash;
+		string text;
+		json doc;
+		size_t bytes;
+	};
+
+	void erase(std::list<entry>::iterator it);
+
+	const size_t max_bytes_;
+	// Declared before opts_, which points at it.
+	shape_registry shapes_;
+	const parse_options opts_;
+	mutable std::mutex mutex_;
+	// Most recently used first.
+	std::list<entry> lru_;
+	unordered_map<uint64_t, std::list<entry>::iterator> index_;
+	cache_stats stats_;
+};
+
+}
@@ -0,0 +1,595 @@
+#include "quarkson_columnar.hpp"
+#include "quarkson_parser.hpp"
+#include "quarkson_simd.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <type_traits>
+
+namespace quarkson {
+
+namespace {
+
+vector<string> split_path(const string &path)
+{
+	vector<string> segments;
+	size_t from = 0;
+	for (;;)
+	{
+		size_t dot = path.find('.', from);
+		segments.push_back(path.substr(from, dot == string::npos ? string::npos : dot - from));
+		if (dot == string::npos)
+			return segments;
+		from = dot + 1;
+	}
+}
+
+unsigned popcount64(uint64_t x)
+{
+	x = x - ((x >> 1) & 0x5555555555555555ULL);
+	x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+	x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	return static_cast<unsigned>((x * 0x0101010101010101ULL) >> 56);
+}
+
+// Owns the output columns while rows are appended. Every row starts null;
+// the first value stored for a (row, column) wins, as with duplicate keys
+// in json::object.
+class table_builder
+{
+public:
+	explicit table_builder(const vector<column_spec> &specs)
+	{
+		for (const column_spec &spec : specs)
+		{
+			column c;
+			c.path = spec.path;
+			c.type = spec.type;
+			if (c.type == column_type::STRING)
+				c.offsets.push_back(0);
+			table_.columns.push_back(std::move(c));
+		}
+	}
+
+	void begin_row()
+	{
+		size_t row = table_.rows;
+		for (column &c : table_.columns)
+		{
+			if ((row & 63) == 0)
+				c.validity.push_back(0);
+			if (c.type == column_type::DOUBLE)
+				c.doubles.push_back(0);
+			else if (c.type == column_type::INT64)
+				c.ints.push_back(0);
+		}
+	}
+
+	void end_row()
+	{
+		for (column &c : table_.columns)
+			if (c.type == column_type::STRING)
+				c.offsets.push_back(c.blob.size());
+		++table_.rows;
+	}
+
+	// Drops the row begun last, which failed partway.
+	void abort_row()
+	{
+		size_t row = table_.rows;
+		for (column &c : table_.columns)
+		{
+			if ((row & 63) == 0)
+				c.validity.pop_back();
+			else
+				c.validity.back() &= ~(uint64_t(1) << (row & 63));
+			if (c.type == column_type::DOUBLE)
+				c.doubles.pop_back();
+			else if (c.type == column_type::INT64)
+				c.ints.pop_back();
+			else
+				c.blob.resize(c.offsets.back());
+		}
+	}
+
+	column & at(size_t i) { return table_.columns[i]; }
+
+	bool has_value(size_t i) const { return table_.columns[i].is_valid(table_.rows); }
+
+	void set_valid(size_t i)
+	{
+		size_t row = table_.rows;
+		table_.columns[i].validity[row >> 6] |= uint64_t(1) << (row & 63);
+	}
+
+	void set_double(size_t i, double v)
+	{
+		table_.columns[i].doubles[table_.rows] = v;
+		set_valid(i);
+	}
+
+	void set_int64(size_t i, int64_t v)
+	{
+		table_.columns[i].ints[table_.rows] = v;
+		set_valid(i);
+	}
+
+	column_table finish()
+	{
+		for (column &c : table_.columns)
+		{
+			size_t valid = 0;
+			for (uint64_t word : c.validity)
+				valid += popcount64(word);
+			c.null_count = table_.rows - valid;
+		}
+		return std::move(table_);
+	}
+
+private:
+	column_table table_;
+};
+
+bool double_to_int64(double d, int64_t &out)
+{
+	if (!(d >= -9223372036854775808.0 && d < 9223372036854775808.0) || d != std::floor(d))
+		return false;
+	out = static_cast<int64_t>(d);
+	return true;
+}
+
+// Member names of all specs as a tree; a node lists the columns whose path
+// ends there.
+struct path_node
+{
+	vector<std::pair<string, size_t>> children;
+	vector<size_t> columns;
+};
+
+class text_extractor
+{
+public:
+	text_extractor(const string &text, const vector<column_spec> &specs) : p_(text), out_(specs)
+	{
+		nodes_.emplace_back();
+		for (size_t i = 0; i < specs.size(); ++i)
+		{
+			size_t node = 0;
+			for (const string &segment : split_path(specs[i].path))
+				node = child(node, segment, true);
+			nodes_[node].columns.push_back(i);
+		}
+	}
+
+	column_table run(string &err)
+	{
+		p_.skip_space();
+		if (*p_.p != '[')
+			fail("expected array of records");
+		else
+		{
+			++p_.p;
+			p_.skip_space();
+			if (*p_.p == ']')
+				++p_.p;
+			else
+				read_records();
+		}
+
+		if (!p_.err.empty())
+			err = p_.err + " at offset " + std::to_string(p_.err_offset);
+		return out_.finish();
+	}
+
+private:
+	size_t child(size_t node, const string &name, bool create)
+	{
+		for (const auto &c : nodes_[node].children)
+			if (c.first == name)
+				return c.second;
+		if (!create)
+			return 0;
+		nodes_.emplace_back();
+		nodes_[node].children.emplace_back(name, nodes_.size() - 1);
+		return nodes_.size() - 1;
+	}
+
+	bool fail(const char *what) { return p_.fail(what, p_.p); }
+
+	void read_records()
+	{
+		for (;;)
+		{
+			out_.begin_row();
+			p_.skip_space();
+			bool ok = *p_.p == '{' ? read_object(0) : p_.skip_value() || fail("invalid value");
+			if (!ok)
+			{
+				out_.abort_row();
+				return;
+			}
+			out_.end_row();
+
+			p_.skip_space();
+			char c = *p_.p++;
+			if (c == ']')
+				return;
+			if (c != ',')
+			{
+				--p_.p;
+				fail("expected ',' or ']'");
+				return;
+			}
+		}
+	}
+
+	bool read_object(size_t node)
+	{
+		++p_.p;
+		p_.skip_space();
+		if (*p_.p == '}')
+		{
+			++p_.p;
+			return true;
+		}
+
+		for (;;)
+		{
+			p_.skip_space();
+			key_.clear();
+			if (*p_.p != '"' || !p_.parse_string_raw(key_))
+				return fail("expected object key");
+			p_.skip_space();
+			if (*p_.p++ != ':')
+				return fail("expected ':'");
+			p_.skip_space();
+
+			size_t next = child(node, key_, false);
+			if (next == 0)
+			{
+				if (!p_.skip_value())
+					return fail("invalid value");
+			}
+			else if (*p_.p == '{' && !nodes_[next].children.empty())
+			{
+				if (!read_object(next))
+					return false;
+			}
+			else if (!read_field(nodes_[next]))
+				return false;
+
+			p_.skip_space();
+			char c = *p_.p++;
+			if (c == '}')
+				return true;
+			if (c != ',')
+			{
+				--p_.p;
+				return fail("expected ',' or '}'");
+			}
+		}
+	}
+
+	// Stores the value at p into every column of node that has its type
+	// and no value yet, otherwise steps over it. The value is read once.
+	bool read_field(const path_node &node)
+	{
+		char ch = *p_.p;
+		if (ch == '"')
+		{
+			// Unescaped into the first column and copied to the others.
+			column *first = nullptr;
+			size_t from = 0;
+			for (size_t i : node.columns)
+			{
+				if (out_.has_value(i) || out_.at(i).type != column_type::STRING)
+					continue;
+				if (first == nullptr)
+				{
+					first = &out_.at(i);
+					from = first->blob.size();
+					if (!p_.parse_string_raw(first->blob))
+						return fail("invalid string");
+				}
+				else
+					out_.at(i).blob.append(first->blob, from, string::npos);
+				out_.set_valid(i);
+			}
+			if (first != nullptr)
+				return true;
+		}
+		else if (ch == '-' || (ch >= '0' && ch <= '9'))
+		{
+			bool doubles = false, ints = false;
+			for (size_t i : node.columns)
+				if (!out_.has_value(i))
+				{
+					doubles = doubles || out_.at(i).type == column_type::DOUBLE;
+					ints = ints || out_.at(i).type == column_type::INT64;
+				}
+			if (doubles || ints)
+			{
+				double d = 0;
+				int64_t n = 0;
+				bool integral;
+				if (!read_number(doubles, d, n, integral))
+					return fail("invalid number");
+				for (size_t i : node.columns)
+				{
+					if (out_.has_value(i))
+						continue;
+					if (out_.at(i).type == column_type::DOUBLE)
+						out_.set_double(i, d);
+					else if (out_.at(i).type == column_type::INT64 && integral)
+						out_.set_int64(i, n);
+				}
+				return true;
+			}
+		}
+
+		return p_.skip_value() || fail("invalid value");
+	}
+
+	// Integers are read exactly for INT64 columns; other numbers count there
+	// only if they are integral. d is set if need_double or not integral.
+	bool read_number(bool need_double, double &d, int64_t &v, bool &integral)
+	{
+		const char *end = p_.number_end();
+		if (end == nullptr)
+			return false;
+		if (std::find_if(p_.p, end, [](char ch) { return ch == '.' || ch == 'e' || ch == 'E'; }) == end)
+		{
+			errno = 0;
+			long long n = std::strtoll(p_.p, nullptr, 10);
+			if (errno != ERANGE)
+			{
+				if (need_double)
+					d = std::strtod(p_.p, nullptr);
+				p_.p = end;
+				v = n;
+				integral = true;
+				return true;
+			}
+		}
+
+		if (!p_.parse_number_raw(d))
+			return false;
+		integral = double_to_int64(d, v);
+		return true;
+	}
+
+	parser p_;
+	table_builder out_;
+	vector<path_node> nodes_;
+	string key_;
+};
+
+double sum_dense(const double *v, size_t n)
+{
+	size_t i = 0;
+	double total = 0;
+#ifdef QUARKSON_SSE2
+	__m128d a0 = _mm_setzero_pd(), a1 = _mm_setzero_pd();
+	for (; i + 4 <= n; i += 4)
+	{
+		a0 = _mm_add_pd(a0, _mm_loadu_pd(v + i));
+		a1 = _mm_add_pd(a1, _mm_loadu_pd(v + i + 2));
+	}
+	double lanes[2];
+	_mm_storeu_pd(lanes, _mm_add_pd(a0, a1));
+	total = lanes[0] + lanes[1];
+#endif
+	for (; i < n; ++i)
+		total += v[i];
+	return total;
+}
+
+template <bool Min>
+double extreme_dense(const double *v, size_t n, double best)
+{
+	size_t i = 0;
+#ifdef QUARKSON_SSE2
+	__m128d a0 = _mm_set1_pd(best), a1 = a0;
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128d x0 = _mm_loadu_pd(v + i), x1 = _mm_loadu_pd(v + i + 2);
+		a0 = Min ? _mm_min_pd(a0, x0) : _mm_max_pd(a0, x0);
+		a1 = Min ? _mm_min_pd(a1, x1) : _mm_max_pd(a1, x1);
+	}
+	double lanes[2];
+	_mm_storeu_pd(lanes, Min ? _mm_min_pd(a0, a1) : _mm_max_pd(a0, a1));
+	for (double x : lanes)
+		best = Min ? (x < best ? x : best) : (x > best ? x : best);
+#endif
+	for (; i < n; ++i)
+		best = Min ? (v[i] < best ? v[i] : best) : (v[i] > best ? v[i] : best);
+	return best;
+}
+
+// Null slots hold 0, which would win min or max, so only runs of 64 valid
+// rows take the dense kernel; the rest go row by row.
+template <bool Min, typename T>
+T extreme(const column &c, const vector<T> &v, T best)
+{
+	size_t n = v.size();
+	if (c.null_count == 0)
+	{
+		if constexpr (std::is_same_v<T, double>)
+			return extreme_dense<Min>(v.data(), n, best);
+	}
+
+	for (size_t w = 0; w < c.validity.size(); ++w)
+	{
+		size_t base = w * 64;
+		size_t len = n - base < 64 ? n - base : 64;
+		uint64_t bits = c.validity[w];
+		if constexpr (std::is_same_v<T, double>)
+		{
+			if (len == 64 && bits == ~uint64_t(0))
+			{
+				best = extreme_dense<Min>(v.data() + base, 64, best);
+				continue;
+			}
+		}
+		for (; bits; bits &= bits - 1)
+		{
+			T x = v[base + simd::ctz64(bits)];
+			best = Min ? (x < best ? x : best) : (x > best ? x : best);
+		}
+	}
+	return best;
+}
+
+}
+
+const column * column_table::find(string_view path) const
+{
+	for (const column &c : columns)
+		if (c.path == path)
+			return &c;
+	return nullptr;
+}
+
+column_table columnar::extract(const json &records, const vector<column_spec> &specs)
+{
+	// Keys view these strings, so they are built once up front.
+	vector<vector<string>> names;
+	for (const column_spec &spec : specs)
+		names.push_back(split_path(spec.path));
+	vector<vector<json::key>> paths;
+	for (const vector<string> &segments : names)
+		paths.emplace_back(segments.begin(), segments.end());
+
+	table_builder out(specs);
+	if (records.type() != json::json_type::ARRAY)
+		return out.finish();
+
+	for (const shared_ptr<json_value> &record : records.get_array())
+	{
+		out.begin_row();
+		for (size_t i = 0; i < specs.size(); ++i)
+		{
+			const json_value *v = record.get();
+			for (const json::key &k : paths[i])
+			{
+				if (v->type() != json::json_type::OBJECT)
+				{
+					v = nullptr;
+					break;
+				}
+				v = v->find(k).get();
+				if (v == nullptr)
+					break;
+			}
+			if (v == nullptr)
+				continue;
+
+			int64_t n;
+			switch (specs[i].type)
+			{
+			case column_type::DOUBLE:
+				if (v->type() == json::json_type::NUMBER)
+					out.set_double(i, v->get_number());
+				break;
+			case column_type::INT64:
+				if (v->type() == json::json_type::NUMBER && double_to_int64(v->get_number(), n))
+					out.set_int64(i, n);
+				break;
+			case column_type::STRING:
+				if (v->type() == json::json_type::STRING)
+				{
+					out.at(i).blob += v->get_string();
+					out.set_valid(i);
+				}
+				break;
+			}
+		}
+		out.end_row();
+	}
+	return out.finish();
+}
+
+column_table columnar::extract(const string &text, const vector<column_spec> &specs)
+{
+	string err;
+	return extract(text, specs, err);
+}
+
+column_table columnar::extract(const string &text, const vector<column_spec> &specs, string &err)
+{
+	text_extractor x(text, specs);
+	return x.run(err);
+}
+
+size_t columnar::count(const column &c)
+{
+	size_t rows;
+	if (c.type == column_type::STRING)
+		rows = c.offsets.size() - 1;
+	else
+		rows = c.type == column_type::DOUBLE ? c.doubles.size() : c.ints.size();
+	return rows - c.null_count;
+}
+
+double columnar::sum(const column &c)
+{
+	if (c.type == column_type::INT64)
+		return static_cast<double>(sum_int64(c));
+	// Null slots hold 0, so they can be summed with the rest.
+	return sum_dense(c.doubles.data(), c.doubles.size());
+}
+
+double columnar::min(const column &c)
+{
+	if (count(c) == 0)
+		return std::numeric_limits<double>::quiet_NaN();
+	if (c.type == column_type::INT64)
+		return static_cast<double>(min_int64(c));
+	return extreme<true>(c, c.doubles, std::numeric_limits<double>::infinity());
+}
+
+double columnar::max(const column &c)
+{
+	if (count(c) == 0)
+		return std::numeric_limits<double>::quiet_NaN();
+	if (c.type == column_type::INT64)
+		return static_cast<double>(max_int64(c));
+	return extreme<false>(c, c.doubles, -std::numeric_limits<double>::infinity());
+}
+
+int64_t columnar::sum_int64(const column &c)
+{
+	// Four independent accumulators let the compiler vectorize the loop.
+	const int64_t *v = c.ints.data();
+	size_t n = c.ints.size(), i = 0;
+	int64_t a0 = 0, a1 = 0, a2 = 0, a3 = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		a0 += v[i];
+		a1 += v[i + 1];
+		a2 += v[i + 2];
+		a3 += v[i + 3];
+	}
+	for (; i < n; ++i)
+		a0 += v[i];
+	return a0 + a1 + a2 + a3;
+}
+
+int64_t columnar::min_int64(const column &c)
+{
+	if (count(c) == 0)
+		return 0;
+	return extreme<true>(c, c.ints, std::numeric_limits<int64_t>::max());
+}
+
+int64_t columnar::max_int64(const column &c)
+{
+	if (count(c) == 0)
+		return 0;
+	return extreme<false>(c, c.ints, std::numeric_limits<int64_t>::min());
+}
+
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "json.hpp"
+
+namespace quarkson {
+
+enum class column_type
+{
+	DOUBLE,
+	INT64,
+	STRING
+};
+
+struct column_spec
+{
+	// Member names separated by '.', e.g. "Image.Thumbnail.Width".
+	string path;
+	column_type type;
+};
+
+// One field of every record, stored contiguously. Rows whose field is
+// missing or of another type are null: their validity bit is clear and
+// their numeric slot holds 0 (strings are empty).
+struct column
+{
+	string path;
+	column_type type;
+
+	vector<double> doubles;
+	vector<int64_t> ints;
+	// Row i of a STRING column is blob[offsets[i], offsets[i + 1]).
+	vector<uint64_t> offsets;
+	string blob;
+
+	// Bit i % 64 of validity[i / 64] is set if row i holds a value.
+	vector<uint64_t> validity;
+	size_t null_count = 0;
+
+	bool is_valid(size_t row) const { return (validity[row >> 6] >> (row & 63)) & 1; }
+	string_view get_string(size_t row) const { return string_view(blob).substr(offsets[row], offsets[row + 1] - offsets[row]); }
+};
+
+struct column_table
+{
+	size_t rows = 0;
+	vector<column> columns;
+
+	const column * find(string_view path) const;
+};
+
+// Pivots an array of objects into struct-of-arrays columns.
+class columnar
+{
+public:
+	static column_table extract(const json &records, const vector<column_spec> &specs);
+
+	// Reads the records straight from text: members outside the specs are
+	// skipped unparsed and no per-record object is ever built. On malformed
+	// input err is set and the rows read so far are returned.
+	static column_table extract(const string &text, const vector<column_spec> &specs);
+	static column_table extract(const string &text, const vector<column_spec> &specs, string &err);
+
+	// Rows holding a value, for any column type.
+	static size_t count(const column &);
+	// Kernels over DOUBLE and INT64 columns; nulls are skipped. min and max
+	// of a column without values are NaN (INT64: 0).
+	static double sum(const column &);
+	static double min(const column &);
+	static double max(const column &);
+	static int64_t sum_int64(const column &);
+	static int64_t min_int64(const column &);
+	static int64_t max_int64(const column &);
+};
+
+}
@@ -0,0 +1,455 @@
+#include "quarkson_format.hpp"
+#include "quarkson_simd.hpp"
+#include "quarkson_utf8.hpp"
+
+#include <bit>
+#include <cstring>
+
+namespace quarkson {
+
+namespace {
+
+bool is_digit(char ch) { return ch >= '0' && ch <= '9'; }
+
+bool is_hex(char ch)
+{
+	return (ch >= '0' && ch <= '9') || (ch >= 'A' && ch <= 'F') || (ch >= 'a' && ch <= 'f');
+}
+
+// p points at the opening quote. Returns one past the closing quote, or
+// nullptr if the literal is malformed or unterminated.
+const char * scan_string(const char *p, const char *e)
+{
+	++p;
+	for (;;)
+	{
+		p = simd::find_string_special(p, e);
+		if (p == e)
+			return nullptr;
+		if (*p == '"')
+			return p + 1;
+		if (*p != '\\' || ++p == e)
+			return nullptr;
+
+		switch (*p)
+		{
+		case '\"':
+		case '\\':
+		case '/':
+		case 'b':
+		case 'f':
+		case 'n':
+		case 'r':
+		case 't':
+			++p;
+			break;
+		case 'u':
+			if (e - p < 5 || !is_hex(p[1]) || !is_hex(p[2]) || !is_hex(p[3]) || !is_hex(p[4]))
+				return nullptr;
+			p += 5;
+			break;
+		default:
+			return nullptr;
+		}
+	}
+}
+
+const char * scan_number(const char *p, const char *e)
+{
+	if (p != e && *p == '-') ++p;
+
+	if (p == e)
+		return nullptr;
+	if (*p == '0')
+		++p;
+	else if (*p >= '1' && *p <= '9')
+		for (++p; p != e && is_digit(*p); ++p);
+	else
+		return nullptr;
+
+	if (p != e && *p == '.')
+	{
+		if (++p == e || !is_digit(*p))
+			return nullptr;
+		for (++p; p != e && is_digit(*p); ++p);
+	}
+
+	if (p != e && (*p == 'e' || *p == 'E'))
+	{
+		if (++p != e && (*p == '+' || *p == '-'))
+			++p;
+		if (p == e || !is_digit(*p))
+			return nullptr;
+		for (++p; p != e && is_digit(*p); ++p);
+	}
+
+	return p;
+}
+
+const char * scan_literal(const char *p, const char *e)
+{
+	size_t n = *p == 'f' ? 5 : 4;
+	const char *lit = *p == 't' ? "true" : *p == 'f' ? "false" : "null";
+	if (static_cast<size_t>(e - p) < n || memcmp(p, lit, n) != 0)
+		return nullptr;
+	return p + n;
+}
+
+bool is_scalar_end(const char *q, const char *e)
+{
+	return q == e || simd::is_space(*q) || simd::is_op(*q) || *q == '"';
+}
+
+bool check_escapes(uint64_t escaped, const char *base, const char *e)
+{
+	for (; escaped; escaped &= escaped - 1)
+	{
+		const char *c = base + simd::ctz64(escaped);
+		if (c >= e)
+			return false;
+
+		switch (*c)
+		{
+		case '\"':
+		case '\\':
+		case '/':
+		case 'b':
+		case 'f':
+		case 'n':
+		case 'r':
+		case 't':
+			break;
+		case 'u':
+			if (e - c < 5 || !is_hex(c[1]) || !is_hex(c[2]) || !is_hex(c[3]) || !is_hex(c[4]))
+				return false;
+			break;
+		default:
+			return false;
+		}
+	}
+	return true;
+}
+
+bool valid_utf8(const char *p, const char *e)
+{
+	return utf8::validate(p, e - p) == static_cast<size_t>(e - p);
+}
+
+// Checks the strings of a block that hold non-ASCII bytes (high), each as a
+// whole once its closing quote turns up. open is the opening quote of the
+// string in progress and pending whether it holds such bytes already.
+bool check_strings_utf8(uint64_t quote, uint64_t in_string, uint64_t high, const char *base, const char *&open, bool &pending)
+{
+	for (; quote; quote &= quote - 1)
+	{
+		unsigned i = simd::ctz64(quote);
+		if (in_string >> i & 1)
+		{
+			open = base + i;
+			continue;
+		}
+		uint64_t before = (uint64_t(1) << i) - 1;
+		if ((pending || (high & before)) && !valid_utf8(open + 1, base + i))
+			return false;
+		high &= ~before;
+		pending = false;
+	}
+	pending = pending || high != 0;
+	return true;
+}
+
+// Minified output is the input without the whitespace outside string
+// literals. The input is classified 64 bytes at a time: string interiors are
+// found with a prefix xor over the unescaped quotes, whitespace outside them
+// is cut out with a handful of copies per block, and only the token starts
+// go through the grammar check below.
+bool minify_blocks(const char *p, const char *e, string &out)
+{
+	enum { VALUE, ARRAY_FIRST, OBJECT_FIRST, KEY, COLON, NEXT, DONE } state = VALUE;
+	vector<char> stack;
+	uint64_t escape_carry = 0;
+	uint64_t string_carry = 0;
+	uint64_t scalar_carry = 0;
+	const char *open = nullptr;
+	bool pending_utf8 = false;
+	char tail[64];
+
+	out.resize((e - p) + 64);
+	char *w = &out[0];
+
+	for (const char *base = p; base < e; base += 64)
+	{
+		const char *src = base;
+		if (e - base < 64)
+		{
+			memset(tail, ' ', sizeof(tail));
+			memcpy(tail, base, e - base);
+			src = tail;
+		}
+
+		simd::block b = simd::classify(src);
+		uint64_t escaped = simd::find_escaped(b.backslash, escape_carry);
+		uint64_t quote = b.quote & ~escaped;
+		uint64_t in_string = simd::prefix_xor(quote) ^ string_carry;
+		string_carry = static_cast<uint64_t>(static_cast<int64_t>(in_string) >> 63);
+
+		if (b.control & in_string)
+			return false;
+		if ((escaped & in_string) && !check_escapes(escaped & in_string, base, e))
+			return false;
+		if ((b.high & in_string) || pending_utf8)
+		{
+			if (!check_strings_utf8(quote, in_string, b.high & in_string, base, open, pending_utf8))
+				return false;
+		}
+		else if (quote & in_string)
+			open = base + 63 - std::countl_zero(quote & in_string);
+
+		uint64_t scalar = ~(b.space | b.op | quote | in_string);
+		uint64_t starts = (b.op & ~in_string) | (quote & in_string) | (scalar & ~(scalar << 1 | scalar_carry));
+		scalar_carry = scalar >> 63;
+
+		for (; starts; starts &= starts - 1)
+		{
+			const char *c = base + simd::ctz64(starts);
+			const char *q = nullptr;
+
+			switch (state)
+			{
+			case VALUE:
+			case ARRAY_FIRST:
+				switch (*c)
+				{
+				case '{':
+					stack.push_back('{');
+					state = OBJECT_FIRST;
+					continue;
+				case '[':
+					stack.push_back('[');
+					state = ARRAY_FIRST;
+					continue;
+				case ']':
+					if (state != ARRAY_FIRST)
+						return false;
+					stack.pop_back();
+					break;
+				case '"':
+					break;
+				case 't':
+				case 'f':
+				case 'n':
+					q = scan_literal(c, e);
+					if (q == nullptr || !is_scalar_end(q, e))
+						return false;
+					break;
+				default:
+					q = scan_number(c, e);
+					if (q == nullptr || !is_scalar_end(q, e))
+						return false;
+					break;
+				}
+				state = stack.empty() ? DONE : NEXT;
+				break;
+			case OBJECT_FIRST:
+				if (*c == '}')
+				{
+					stack.pop_back();
+					state = stack.empty() ? DONE : NEXT;
+					break;
+				}
+				if (*c != '"')
+					return false;
+				state = COLON;
+				break;
+			case KEY:
+				if (*c != '"')
+					return false;
+				state = COLON;
+				break;
+			case COLON:
+				if (*c != ':')
+					return false;
+				state = VALUE;
+				break;
+			case NEXT:
+				if (*c == ',')
+					state = stack.back() == '{' ? KEY : VALUE;
+				else if (*c == (stack.back() == '{' ? '}' : ']'))
+				{
+					stack.pop_back();
+					state = stack.empty() ? DONE : NEXT;
+				}
+				else
+					return false;
+				break;
+			case DONE:
+				return false;
+			}
+		}
+
+		uint64_t keep = ~(b.space & ~in_string);
+		if (keep == ~uint64_t(0))
+		{
+			memcpy(w, src, 64);
+			w += 64;
+			continue;
+		}
+		while (keep)
+		{
+			unsigned from = simd::ctz64(keep);
+			uint64_t rest = ~(keep >> from);
+			unsigned len = rest ? simd::ctz64(rest) : 64 - from;
+			memcpy(w, src + from, len);
+			w += len;
+			keep = from + len < 64 ? keep & (~uint64_t(0) << (from + len)) : 0;
+		}
+	}
+
+	if (state != DONE || string_carry)
+		return false;
+	out.resize(w - out.data());
+	return true;
+}
+
+// Pretty output needs every token re-emitted anyway, so this walks the
+// input token by token; string literals are still copied in bulk.
+bool prettify_tokens(const char *p, const char *e, string &out, unsigned indent)
+{
+	vector<char> stack;
+
+	out.clear();
+	out.reserve((e - p) * 2);
+
+	auto newline = [&]()
+	{
+		out.push_back('\n');
+		out.append(stack.size() * indent, ' ');
+	};
+
+	// Copies "key": and leaves p at the member value.
+	auto read_key = [&]()
+	{
+		if (p == e || *p != '"')
+			return false;
+		const char *q = scan_string(p, e);
+		if (q == nullptr || !valid_utf8(p + 1, q - 1))
+			return false;
+		out.append(p, q);
+		p = simd::skip_space(q, e);
+		if (p == e || *p++ != ':')
+			return false;
+		out += ": ";
+		p = simd::skip_space(p, e);
+		return true;
+	};
+
+	p = simd::skip_space(p, e);
+	for (;;)
+	{
+		if (p == e)
+			return false;
+
+		const char *q = nullptr;
+		switch (*p)
+		{
+		case '{':
+		case '[':
+		{
+			char open = *p;
+			char close = open == '{' ? '}' : ']';
+			out.push_back(open);
+			p = simd::skip_space(p + 1, e);
+			if (p != e && *p == close)
+			{
+				out.push_back(close);
+				q = ++p;
+				break;
+			}
+			stack.push_back(open);
+			newline();
+			if (open == '{' && !read_key())
+				return false;
+			continue;
+		}
+		case '"':
+			q = scan_string(p, e);
+			if (q != nullptr && !valid_utf8(p + 1, q - 1))
+				return false;
+			break;
+		case 't':
+		case 'f':
+		case 'n':
+			q = scan_literal(p, e);
+			break;
+		default:
+			q = scan_number(p, e);
+			break;
+		}
+		if (q == nullptr)
+			return false;
+		out.append(p, q);
+		p = q;
+
+		// A value has been copied; close any containers that end here and
+		// stop at the next separator.
+		for (;;)
+		{
+			if (stack.empty())
+				return simd::skip_space(p, e) == e;
+			p = simd::skip_space(p, e);
+			if (p == e)
+				return false;
+
+			char c = *p++;
+			char open = stack.back();
+			if (c == ',')
+			{
+				out.push_back(',');
+				newline();
+				p = simd::skip_space(p, e);
+				if (open == '{' && !read_key())
+					return false;
+				break;
+			}
+			if (c != (open == '{' ? '}' : ']'))
+				return false;
+			stack.pop_back();
+			newline();
+			out.push_back(c);
+		}
+	}
+}
+
+}
+
+bool formatter::minify(const string &in, string &out)
+{
+	if (minify_blocks(in.data(), in.data() + in.size(), out))
+		return true;
+	out.clear();
+	return false;
+}
+
+string formatter::minify(const string &in)
+{
+	string out;
+	minify(in, out);
+	return out;
+}
+
+bool formatter::prettify(const string &in, string &out, unsigned indent)
+{
+	if (prettify_tokens(in.data(), in.data() + in.size(), out, indent))
+		return true;
+	out.clear();
+	return false;
+}
+
+string formatter::prettify(const string &in, unsigned indent)
+{
+	string out;
+	prettify(in, out, indent);
+	return out;
+}
+
+}
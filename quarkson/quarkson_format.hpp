@@ -0,0 +1,20 @@
+#pragma once
+
+#include "json.hpp"
+
+namespace quarkson {
+
+// Text-to-text reformatting. The input is validated while it is copied, no
+// DOM is built. On malformed input the bool overloads return false and leave
+// out empty; the string overloads return an empty string.
+class formatter
+{
+public:
+	static bool minify(const string &in, string &out);
+	static string minify(const string &in);
+
+	static bool prettify(const string &in, string &out, unsigned indent = 4);
+	static string prettify(const string &in, unsigned indent = 4);
+};
+
+}
@@ -0,0 +1,389 @@
+#include "quarkson_generator.hpp"
+#include "quarkson_simd.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cmath>
+#include <deque>
+#include <thread>
+
+namespace quarkson {
+
+namespace {
+
+// The children of an array or object, by position.
+class children
+{
+public:
+	explicit children(const json_value &v) : v_(v), nums_(v.get_numbers()), shape_(v.shape())
+	{
+		if (v.type() == json::json_type::ARRAY)
+		{
+			arr_ = nums_.empty() ? &v.get_array() : nullptr;
+			size_ = arr_ ? arr_->size() : nums_.size();
+		}
+		else if (shape_)
+			size_ = shape_->keys().size();
+		else
+		{
+			members_.reserve(v.get_object().size());
+			for (const auto &m : v.get_object())
+				members_.push_back(&m);
+			size_ = members_.size();
+		}
+	}
+
+	size_t size() const { return size_; }
+	bool is_object() const { return v_.type() == json::json_type::OBJECT; }
+	bool packed() const { return !nums_.empty(); }
+
+	double number(size_t i) const { return nums_[i]; }
+	const string & name(size_t i) const { return shape_ ? shape_->keys()[i] : members_[i]->first; }
+	const json_value & value(size_t i) const
+	{
+		if (arr_)
+			return *(*arr_)[i];
+		return shape_ ? *v_.get_values()[i] : *members_[i]->second;
+	}
+
+private:
+	const json_value &v_;
+	std::span<const double> nums_;
+	const object_shape *shape_;
+	const json::array *arr_ = nullptr;
+	vector<const json::object::value_type *> members_;
+	size_t size_ = 0;
+};
+
+size_t child_count(const json_value &v)
+{
+	switch (v.type())
+	{
+	case json::json_type::ARRAY:
+		return v.is_packed() ? v.get_numbers().size() : v.get_array().size();
+	case json::json_type::OBJECT:
+		return v.shape() ? v.shape()->keys().size() : v.get_object().size();
+	default:
+		return 0;
+	}
+}
+
+// Rough upper bound on the text of a value, for sizing buffers. Walks an
+// explicit stack, so depth costs heap rather than call stack.
+size_t estimate(const json_value &root)
+{
+	const size_t NUMBER = 24;
+	size_t n = 0;
+	vector<const json_value *> todo(1, &root);
+	while (!todo.empty())
+	{
+		const json_value &v = *todo.back();
+		todo.pop_back();
+		switch (v.type())
+		{
+		case json::json_type::STRING:
+			n += v.get_string().size() + 2;
+			break;
+		case json::json_type::NUMBER:
+			n += NUMBER;
+			break;
+		case json::json_type::ARRAY:
+			n += 2;
+			if (v.is_packed())
+				n += v.get_numbers().size() * (NUMBER + 1);
+			else
+				for (const auto &e : v.get_array())
+				{
+					n += 1;
+					todo.push_back(e.get());
+				}
+			break;
+		case json::json_type::OBJECT:
+			n += 2;
+			if (v.shape())
+				for (size_t i = 0; i < v.shape()->keys().size(); ++i)
+				{
+					n += v.shape()->keys()[i].size() + 4;
+					todo.push_back(v.get_values()[i].get());
+				}
+			else
+				for (const auto &m : v.get_object())
+				{
+					n += m.first.size() + 4;
+					todo.push_back(m.second.get());
+				}
+			break;
+		default:
+			n += 5;
+			break;
+		}
+	}
+	return n;
+}
+
+// Writes values on an explicit stack of open containers, as the parser
+// reads them, so that any document the parser built can be written.
+class writer
+{
+public:
+	// The first occurrence of a non-null hole is left out of the text;
+	// hole_at is where it goes. Shared nodes may occur again.
+	writer(string &out, const json_value *hole = nullptr) : out_(out), hole_(hole) {}
+
+	size_t hole_at = string::npos;
+
+	void value(const json_value &v)
+	{
+		open(v);
+		drain();
+	}
+
+	// Children [b, e) separated by commas.
+	void range(const children &c, size_t b, size_t e)
+	{
+		stack_.push_back({ &c, b, b, e, false });
+		drain();
+	}
+
+private:
+	struct frame
+	{
+		const children *c;
+		size_t begin;
+		size_t next;
+		size_t end;
+		// Opened here: closed here, and its children owned by open_.
+		bool owned;
+	};
+
+	// Writes a scalar, or the opening bracket of a container whose
+	// children drain() then writes.
+	void open(const json_value &v)
+	{
+		if (&v == hole_)
+		{
+			hole_at = out_.size();
+			hole_ = nullptr;
+			return;
+		}
+		switch (v.type())
+		{
+		case json::json_type::BOOLEAN:
+			out_ += v.get_bool() ? "true" : "false";
+			break;
+		case json::json_type::NUMBER:
+			number(v.get_number());
+			break;
+		case json::json_type::STRING:
+			string_literal(v.get_string());
+			break;
+		case json::json_type::ARRAY:
+		case json::json_type::OBJECT:
+		{
+			open_.emplace_back(v);
+			const children &c = open_.back();
+			out_ += c.is_object() ? '{' : '[';
+			stack_.push_back({ &c, 0, 0, c.size(), true });
+			break;
+		}
+		default:
+			out_ += "null";
+			break;
+		}
+	}
+
+	void drain()
+	{
+		while (!stack_.empty())
+		{
+			frame &f = stack_.back();
+			if (f.next == f.end)
+			{
+				if (f.owned)
+				{
+					out_ += f.c->is_object() ? '}' : ']';
+					open_.pop_back();
+				}
+				stack_.pop_back();
+				continue;
+			}
+			const children &c = *f.c;
+			size_t i = f.next++;
+			if (i != f.begin)
+				out_ += ',';
+			if (c.packed())
+			{
+				number(c.number(i));
+				continue;
+			}
+			if (c.is_object())
+			{
+				string_literal(c.name(i));
+				out_ += ':';
+			}
+			// May push a frame, so f is not used past here.
+			open(c.value(i));
+		}
+	}
+
+	void number(double d)
+	{
+		if (!std::isfinite(d))
+		{
+			out_ += "null";
+			return;
+		}
+		char buf[32];
+		out_.append(buf, std::to_chars(buf, buf + sizeof(buf), d).ptr);
+	}
+
+	void string_literal(const string &s)
+	{
+		static const char HEX[] = "0123456789ABCDEF";
+		out_ += '"';
+		const char *p = s.data(), *e = p + s.size();
+		for (;;)
+		{
+			const char *q = simd::find_string_special(p, e);
+			out_.append(p, q);
+			if (q == e)
+				break;
+			unsigned char ch = static_cast<unsigned char>(*q);
+			switch (ch)
+			{
+			case '"': out_ += "\\\""; break;
+			case '\\': out_ += "\\\\"; break;
+			case '\b': out_ += "\\b"; break;
+			case '\f': out_ += "\\f"; break;
+			case '\n': out_ += "\\n"; break;
+			case '\r': out_ += "\\r"; break;
+			case '\t': out_ += "\\t"; break;
+			default:
+				out_ += "\\u00";
+				out_ += HEX[ch >> 4];
+				out_ += HEX[ch & 15];
+				break;
+			}
+			p = q + 1;
+		}
+		out_ += '"';
+	}
+
+	string &out_;
+	const json_value *hole_;
+	vector<frame> stack_;
+	// A deque, so that frames can point at its elements.
+	std::deque<children> open_;
+};
+
+// The container whose children get split: the root, or while that has too
+// few children, the child container with the most of them.
+const json_value & split_target(const json_value &root, size_t wanted)
+{
+	const size_t MAX_DEPTH = 8;
+	const json_value *v = &root;
+	for (size_t depth = 0; depth < MAX_DEPTH && child_count(*v) < wanted && !v->is_packed(); ++depth)
+	{
+		children c(*v);
+		const json_value *best = nullptr;
+		size_t most = child_count(*v);
+		for (size_t i = 0; i < c.size(); ++i)
+		{
+			size_t n = child_count(c.value(i));
+			if (n > most)
+			{
+				best = &c.value(i);
+				most = n;
+			}
+		}
+		if (best == nullptr)
+			break;
+		v = best;
+	}
+	return *v;
+}
+
+}
+
+string generator::generate(const json &v)
+{
+	string out;
+	generate(v, out);
+	return out;
+}
+
+void generator::generate(const json &v, string &out)
+{
+	out.clear();
+	writer(out).value(*v.get());
+}
+
+string generator::generate(const json &v, unsigned threads)
+{
+	string out;
+	generate(v, out, threads);
+	return out;
+}
+
+void generator::generate(const json &v, string &out, unsigned threads)
+{
+	// More chunks than threads, so that a slow chunk does not hold up the rest.
+	const size_t CHUNKS_PER_THREAD = 4;
+
+	const json_value &root = *v.get();
+	if (threads <= 1 || (root.type() != json::json_type::ARRAY && root.type() != json::json_type::OBJECT))
+		return generate(v, out);
+	const json_value &target = split_target(root, threads * CHUNKS_PER_THREAD);
+	children c(target);
+	if (c.size() < 2)
+		return generate(v, out);
+
+	size_t count = std::min(c.size(), threads * CHUNKS_PER_THREAD);
+	vector<string> chunks(count);
+	std::atomic<size_t> next(0);
+	auto work = [&]
+	{
+		for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < count; )
+		{
+			size_t b = c.size() * i / count, e = c.size() * (i + 1) / count;
+			size_t n = 0;
+			if (c.packed())
+				n = (e - b) * 25;
+			else
+				for (size_t j = b; j < e; ++j)
+					n += (c.is_object() ? c.name(j).size() + 4 : 1) + estimate(c.value(j));
+			chunks[i].reserve(n);
+			writer(chunks[i]).range(c, b, e);
+		}
+	};
+	vector<std::thread> pool;
+	for (size_t t = 1; t < std::min<size_t>(threads, count); ++t)
+		pool.emplace_back(work);
+
+	// Everything around the target is written meanwhile, with a hole for it.
+	string outer;
+	writer w(outer, &target);
+	w.value(root);
+	work();
+	for (auto &t : pool)
+		t.join();
+
+	size_t size = outer.size() + 2 + count - 1;
+	for (const auto &s : chunks)
+		size += s.size();
+	out.clear();
+	out.reserve(size);
+	out.append(outer, 0, w.hole_at);
+	out += c.is_object() ? '{' : '[';
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (i != 0)
+			out += ',';
+		out += chunks[i];
+	}
+	out += c.is_object() ? '}' : ']';
+	out.append(outer, w.hole_at, string::npos);
+}
+
+}
@@ -0,0 +1,457 @@
+#include "quarkson_index.hpp"
+#include "quarkson_parser.hpp"
+#include "quarkson_simd.hpp"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace quarkson {
+
+bool mapped_file::open(const string &path)
+{
+	close();
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size))
+	{
+		CloseHandle(file);
+		return false;
+	}
+	file_ = file;
+	size_ = static_cast<size_t>(size.QuadPart);
+	if (size_ == 0)
+	{
+		data_ = "";
+		return true;
+	}
+	mapping_ = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping_ != nullptr)
+		data_ = static_cast<const char *>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+#else
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		::close(fd);
+		return false;
+	}
+	size_ = static_cast<size_t>(st.st_size);
+	if (size_ == 0)
+	{
+		::close(fd);
+		data_ = "";
+		return true;
+	}
+	// The mapping keeps the file open on its own.
+	void *addr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (addr != MAP_FAILED)
+		data_ = static_cast<const char *>(addr);
+#endif
+	if (data_ == nullptr)
+	{
+		close();
+		return false;
+	}
+	return true;
+}
+
+void mapped_file::close()
+{
+#ifdef _WIN32
+	if (data_ != nullptr && size_ != 0)
+		UnmapViewOfFile(data_);
+	if (mapping_ != nullptr)
+		CloseHandle(mapping_);
+	if (file_ != nullptr)
+		CloseHandle(file_);
+	mapping_ = nullptr;
+	file_ = nullptr;
+#else
+	if (data_ != nullptr && size_ != 0)
+		munmap(const_cast<char *>(data_), size_);
+#endif
+	data_ = nullptr;
+	size_ = 0;
+}
+
+namespace {
+
+struct index_header
+{
+	char magic[4];
+	uint32_t version;
+	uint64_t source_size;
+	int64_t source_time;
+	uint64_t count;
+	uint64_t entry_count;
+	uint64_t keys_size;
+	uint64_t key_field_size;
+};
+
+const char MAGIC[4] = { 'Q', 'I', 'D', 'X' };
+const uint32_t VERSION = 1;
+
+size_t pad8(size_t n) { return (n + 7) & ~static_cast<size_t>(7); }
+
+int64_t modification_time(const string &path)
+{
+	std::error_code ec;
+	auto t = std::filesystem::last_write_time(path, ec);
+	return ec ? 0 : static_cast<int64_t>(t.time_since_epoch().count());
+}
+
+// The mapped file is not NUL-terminated, so building steps over values with
+// the parser's bounded skip_value() rather than parsing them.
+class index_builder
+{
+public:
+	index_builder(const char *s, const char *e, const string &key_field) : s_(s), p_(s), e_(e), key_field_(key_field), scan_(s, e) {}
+
+	bool run(string &err)
+	{
+		space();
+		if (p_ == e_ || *p_ != '[')
+			return fail("expected array", err);
+		++p_;
+		space();
+		if (p_ != e_ && *p_ == ']')
+			return finish(err);
+
+		for (;;)
+		{
+			uint64_t element = spans.size() / 2;
+			spans.push_back(static_cast<uint64_t>(p_ - s_));
+			bool ok = !key_field_.empty() && p_ != e_ && *p_ == '{' ? object(element) : value();
+			if (!ok)
+				return fail("invalid value", err);
+			spans.push_back(static_cast<uint64_t>(p_ - s_));
+
+			space();
+			if (p_ == e_)
+				return fail("unexpected end of input", err);
+			char c = *p_++;
+			if (c == ']')
+				return finish(err);
+			if (c != ',')
+			{
+				--p_;
+				return fail("expected ',' or ']'", err);
+			}
+			space();
+		}
+	}
+
+	vector<uint64_t> spans;
+	vector<std::pair<string, uint64_t>> keys;
+
+private:
+	bool finish(string &err)
+	{
+		space();
+		if (p_ != e_)
+			return fail("trailing characters", err);
+		return true;
+	}
+
+	bool fail(const char *what, string &err)
+	{
+		err = string(what) + " at offset " + std::to_string(p_ - s_);
+		return false;
+	}
+
+	void space() { p_ = simd::skip_space(p_, e_); }
+
+	bool string_literal()
+	{
+		scan_.p = p_;
+		bool ok = scan_.skip_string();
+		p_ = scan_.p;
+		return ok;
+	}
+
+	bool value()
+	{
+		if (p_ == e_)
+			return false;
+		scan_.p = p_;
+		bool ok = scan_.skip_value();
+		p_ = scan_.p;
+		return ok;
+	}
+
+	// Decoded text of the string literal [b, e).
+	static bool decode(const char *b, const char *e, string &out)
+	{
+		if (std::find(b, e, '\\') == e)
+		{
+			out.assign(b + 1, e - 1);
+			return true;
+		}
+		string literal(b, e);
+		parser p(literal);
+		out.clear();
+		return p.parse_string_raw(out);
+	}
+
+	// Whether the name literal [b, e) is the key field, escaped or not.
+	bool is_key_field(const char *b, const char *e)
+	{
+		if (std::find(b, e, '\\') == e)
+			return e - b == static_cast<ptrdiff_t>(key_field_.size() + 2) && std::equal(key_field_.begin(), key_field_.end(), b + 1);
+		return decode(b, e, name_) && name_ == key_field_;
+	}
+
+	// Walks the members of an element, noting the key field's value.
+	bool object(uint64_t element)
+	{
+		bool found = false;
+		++p_;
+		space();
+		if (p_ != e_ && *p_ == '}')
+		{
+			++p_;
+			return true;
+		}
+		for (;;)
+		{
+			if (p_ == e_ || *p_ != '\"')
+				return false;
+			const char *name = p_;
+			if (!string_literal())
+				return false;
+			const char *name_end = p_;
+			space();
+			if (p_ == e_ || *p_++ != ':')
+				return false;
+			space();
+
+			const char *v = p_;
+			if (!value())
+				return false;
+			if (!found && is_key_field(name, name_end))
+			{
+				string k;
+				if (*v == '\"')
+				{
+					if (!decode(v, p_, k))
+						return false;
+					found = true;
+				}
+				else if (*v == '-' || (*v >= '0' && *v <= '9'))
+				{
+					k.assign(v, p_);
+					found = true;
+				}
+				if (found)
+					keys.emplace_back(std::move(k), element);
+			}
+
+			space();
+			if (p_ == e_)
+				return false;
+			char c = *p_++;
+			if (c == '}')
+				return true;
+			if (c != ',')
+				return false;
+			space();
+		}
+	}
+
+	const char *s_;
+	const char *p_;
+	const char *e_;
+	const string &key_field_;
+	parser scan_;
+	string name_;
+};
+
+}
+
+bool offset_index::build(const string &path, string &err)
+{
+	return build(path, string(), err);
+}
+
+bool offset_index::build(const string &path, const string &key_field, string &err)
+{
+	mapped_file file;
+	if (!file.open(path))
+	{
+		err = "cannot open " + path;
+		return false;
+	}
+	int64_t time = modification_time(path);
+
+	index_builder b(file.data(), file.data() + file.size(), key_field);
+	if (!b.run(err))
+		return false;
+	std::stable_sort(b.keys.begin(), b.keys.end(),
+		[](const std::pair<string, uint64_t> &a, const std::pair<string, uint64_t> &b) { return a.first < b.first; });
+
+	index_header h = {};
+	memcpy(h.magic, MAGIC, sizeof(MAGIC));
+	h.version = VERSION;
+	h.source_size = file.size();
+	h.source_time = time;
+	h.count = b.spans.size() / 2;
+	h.entry_count = b.keys.size();
+	h.key_field_size = key_field.size();
+
+	vector<key_entry> entries;
+	entries.reserve(b.keys.size());
+	string blob;
+	for (const auto &k : b.keys)
+	{
+		entries.push_back({ blob.size(), k.first.size(), k.second });
+		blob += k.first;
+	}
+	h.keys_size = blob.size();
+
+	string out = index_path(path);
+	std::ofstream os(out, std::ios::binary | std::ios::trunc);
+	const char zeros[8] = {};
+	os.write(reinterpret_cast<const char *>(&h), sizeof(h));
+	os.write(key_field.data(), key_field.size());
+	os.write(zeros, pad8(key_field.size()) - key_field.size());
+	os.write(reinterpret_cast<const char *>(b.spans.data()), b.spans.size() * sizeof(uint64_t));
+	os.write(reinterpret_cast<const char *>(entries.data()), entries.size() * sizeof(key_entry));
+	os.write(blob.data(), blob.size());
+	if (!os.flush())
+	{
+		err = "cannot write " + out;
+		return false;
+	}
+	return true;
+}
+
+bool offset_index::open(const string &path, string &err)
+{
+	index_.close();
+	count_ = entry_count_ = 0;
+	if (!file_.open(path))
+	{
+		err = "cannot open " + path;
+		return false;
+	}
+	string ipath = index_path(path);
+	if (!index_.open(ipath))
+	{
+		err = "cannot open " + ipath;
+		return false;
+	}
+
+	index_header h;
+	if (index_.size() < sizeof(h))
+	{
+		err = "truncated index";
+		return false;
+	}
+	memcpy(&h, index_.data(), sizeof(h));
+	if (memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 || h.version != VERSION)
+	{
+		err = "not an index file";
+		return false;
+	}
+	if (h.source_size != file_.size() || h.source_time != modification_time(path))
+	{
+		err = "index is out of date";
+		return false;
+	}
+	// The counts come from the file, so each is checked against what is
+	// left before it is multiplied.
+	uint64_t left = index_.size() - sizeof(h);
+	bool fits = h.key_field_size <= left && pad8(static_cast<size_t>(h.key_field_size)) <= left;
+	if (fits)
+	{
+		left -= pad8(static_cast<size_t>(h.key_field_size));
+		fits = h.count <= left / (2 * sizeof(uint64_t));
+	}
+	if (fits)
+	{
+		left -= h.count * 2 * sizeof(uint64_t);
+		fits = h.entry_count <= left / sizeof(key_entry);
+	}
+	if (fits)
+	{
+		left -= h.entry_count * sizeof(key_entry);
+		fits = h.keys_size == left;
+	}
+	if (!fits)
+	{
+		err = "truncated index";
+		return false;
+	}
+
+	const char *p = index_.data() + sizeof(h);
+	key_field_.assign(p, h.key_field_size);
+	p += pad8(h.key_field_size);
+	count_ = static_cast<size_t>(h.count);
+	spans_ = reinterpret_cast<const uint64_t *>(p);
+	p += h.count * 2 * sizeof(uint64_t);
+	entry_count_ = static_cast<size_t>(h.entry_count);
+	entries_ = reinterpret_cast<const key_entry *>(p);
+	p += h.entry_count * sizeof(key_entry);
+	keys_ = p;
+	keys_size_ = static_cast<size_t>(h.keys_size);
+	return true;
+}
+
+string_view offset_index::raw(size_t i) const
+{
+	if (i >= count_)
+		return string_view();
+	uint64_t b = spans_[2 * i], e = spans_[2 * i + 1];
+	if (b > e || e > file_.size())
+		return string_view();
+	return string_view(file_.data() + b, static_cast<size_t>(e - b));
+}
+
+json offset_index::at(size_t i) const
+{
+	string err;
+	return at(i, err);
+}
+
+json offset_index::at(size_t i, string &err) const
+{
+	if (i >= count_)
+	{
+		err = "no element " + std::to_string(i) + " of " + std::to_string(count_);
+		return json(json_value::error_instance());
+	}
+	string_view text = raw(i);
+	if (text.empty())
+	{
+		err = "element " + std::to_string(i) + " lies outside the file";
+		return json(json_value::error_instance());
+	}
+	return parser::parse(string(text), err);
+}
+
+size_t offset_index::lookup(string_view k) const
+{
+	const key_entry *end = entries_ + entry_count_;
+	const key_entry *it = std::lower_bound(entries_, end, k,
+		[this](const key_entry &e, string_view k) { return key(e) < k; });
+	return it != end && key(*it) == k && it->element < count_ ? static_cast<size_t>(it->element) : npos;
+}
+
+}
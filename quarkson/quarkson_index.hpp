@@ -0,0 +1,98 @@
+#pragma once
+
+#include "json.hpp"
+
+namespace quarkson {
+
+// A whole file mapped read-only into memory.
+class mapped_file
+{
+public:
+	mapped_file() = default;
+	~mapped_file() { close(); }
+
+	mapped_file(const mapped_file &) = delete;
+	mapped_file & operator=(const mapped_file &) = delete;
+
+	bool open(const string &path);
+	void close();
+
+	const char * data() const { return data_; }
+	size_t size() const { return size_; }
+
+private:
+	const char *data_ = nullptr;
+	size_t size_ = 0;
+#ifdef _WIN32
+	void *file_ = nullptr;
+	void *mapping_ = nullptr;
+#endif
+};
+
+// Random access into a file holding one big JSON array. build() scans the
+// file once and saves where every element starts and ends, optionally with
+// the value of a key member of each element, next to it as <file>.qidx.
+// open() then maps both files, so reading an element parses only its own
+// bytes however large the file is.
+class offset_index
+{
+public:
+	static const size_t npos = static_cast<size_t>(-1);
+
+	static string index_path(const string &path) { return path + ".qidx"; }
+
+	// key_field names a member of the elements whose string or number value
+	// becomes a lookup key; elements without it are reachable by position
+	// only. Empty for no keys.
+	static bool build(const string &path, string &err);
+	static bool build(const string &path, const string &key_field, string &err);
+
+	// Fails if the index is missing or was built for another version of
+	// the file (by size and modification time).
+	bool open(const string &path, string &err);
+
+	size_t size() const { return count_; }
+	const string & key_field() const { return key_field_; }
+
+	// Text of element i; empty if there is no element i or the index
+	// points outside the file.
+	string_view raw(size_t i) const;
+	// Parses element i. Past the end, or for a span outside the file, the
+	// result is an error value.
+	json at(size_t i) const;
+	json at(size_t i, string &err) const;
+
+	// Position of the first element whose key member equals key (numbers
+	// as written in the file), or npos.
+	size_t lookup(string_view key) const;
+
+private:
+	struct key_entry
+	{
+		uint64_t offset;
+		uint64_t length;
+		uint64_t element;
+	};
+
+	// Empty for an entry that points outside the key blob.
+	string_view key(const key_entry &k) const
+	{
+		if (k.offset > keys_size_ || k.length > keys_size_ - k.offset)
+			return string_view();
+		return string_view(keys_ + k.offset, static_cast<size_t>(k.length));
+	}
+
+	mapped_file file_;
+	mapped_file index_;
+	string key_field_;
+	size_t count_ = 0;
+	// begin and end offset of each element.
+	const uint64_t *spans_ = nullptr;
+	// Sorted by key, then element.
+	const key_entry *entries_ = nullptr;
+	size_t entry_count_ = 0;
+	const char *keys_ = nullptr;
+	size_t keys_size_ = 0;
+};
+
+}
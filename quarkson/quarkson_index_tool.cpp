@@ -0,0 +1,84 @@
+#include <iostream>
+#include <cstdlib>
+
+#include "quarkson_index.hpp"
+#include "quarkson_format.hpp"
+
+using std::cout;
+using std::cerr;
+using std::endl;
+
+using quarkson::offset_index;
+using quarkson::formatter;
+
+static int usage()
+{
+	cerr << "usage: quarkson_index_tool build <file.json> [key_field]" << endl
+		<< "       quarkson_index_tool get <file.json> <position>" << endl
+		<< "       quarkson_index_tool find <file.json> <key>" << endl;
+	return 2;
+}
+
+static int print(const offset_index &index, size_t i)
+{
+	string out;
+	if (!formatter::prettify(string(index.raw(i)), out))
+	{
+		cerr << "element " << i << " is not valid JSON" << endl;
+		return 1;
+	}
+	cout << out << endl;
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 3)
+		return usage();
+	string cmd = argv[1], path = argv[2];
+	string err;
+
+	if (cmd == "build")
+	{
+		if (argc > 4)
+			return usage();
+		if (!offset_index::build(path, argc == 4 ? argv[3] : "", err))
+		{
+			cerr << path << ": " << err << endl;
+			return 1;
+		}
+		return 0;
+	}
+
+	if (argc != 4 || (cmd != "get" && cmd != "find"))
+		return usage();
+
+	offset_index index;
+	if (!index.open(path, err))
+	{
+		cerr << path << ": " << err << endl;
+		return 1;
+	}
+
+	size_t i;
+	if (cmd == "get")
+	{
+		char *end;
+		i = static_cast<size_t>(std::strtoull(argv[3], &end, 10));
+		if (*end != '\0' || i >= index.size())
+		{
+			cerr << "no element " << argv[3] << " (" << index.size() << " elements)" << endl;
+			return 1;
+		}
+	}
+	else
+	{
+		i = index.lookup(argv[3]);
+		if (i == offset_index::npos)
+		{
+			cerr << "no element with " << (index.key_field().empty() ? string("a key") : index.key_field()) << " " << argv[3] << endl;
+			return 1;
+		}
+	}
+	return print(index, i);
+}
@@ -1,5 +1,9 @@
 #include "quarkson_parser.hpp"
+#include "quarkson_simd.hpp"
+#include "quarkson_utf8.hpp"
 
+#include <algorithm>
+#include <unordered_set>
 #include <cstring>
 #include <cctype>
 #include <cmath>
@@ -13,15 +17,421 @@ json quarkson::parser::parse(const string &s)
 	return tmp;
 }
 
-json quarkson::parser::parse(const string &s, const string &err)
+json quarkson::parser::parse(const string &s, string &err)
 {
-	parser p(s);
-	shared_ptr<json_value> jv = p.parse_value();
+	return parse(s, err, parse_options());
+}
+
+json quarkson::parser::parse(const string &s, string &err, const parse_options &opts)
+{
+	parser p(s, opts);
+	return p.run(err);
+}
+json quarkson::parser::parse(const string &s, const projection &proj)
+{
+	string err;
+	return parse(s, err, parse_options(), proj);
+}
+json quarkson::parser::parse(const string &s, string &err, const parse_options &opts, const projection &proj)
+{
+	parser p(s, opts);
+	p.proj = &proj;
+	return p.run(err);
+}
+json quarkson::parser::run(string &message)
+{
+	shared_ptr<json_value> jv = parse_value();
+	if (!err.empty())
+	{
+		message = err + " at offset " + std::to_string(err_offset);
+		return json(json_value::error_instance());
+	}
 	json j = json(jv);
 	return j;
 }
 
+bool quarkson::parser::fail(const char *what, const char *at)
+{
+	if (err.empty())
+	{
+		err = what;
+		err_offset = at - s;
+	}
+	return false;
+}
+
+shared_ptr<json_value> quarkson::parser::error(const char *what, const char *at)
+{
+	fail(what, at);
+	return json_value::error_instance();
+}
+
 shared_ptr<json_value> quarkson::parser::parse_value()
+{
+	if (static_cast<size_t>(e - s) > opts.max_size)
+		return error("document too large", s);
+	std::unique_lock<std::mutex> shared;
+	if (opts.shapes && &shapes != &own_shapes)
+		shared = std::unique_lock<std::mutex>(shapes.lock);
+
+	// frames[0, depth) are the open containers, innermost last. Frames are
+	// kept for reuse, so after the first deep document parsing allocates
+	// nothing for the stack itself.
+	size_t depth = 0;
+	shared_ptr<json_value> v;
+
+	for (;;)
+	{
+		skip_space();
+		if (depth != 0 && frames[depth - 1].descended && !frames[depth - 1].is_object && *p != '{' && *p != '[')
+		{
+			const char *at = p;
+			if (!skip_value())
+				return error("invalid value", at);
+			v.reset();
+		}
+		else switch (*p)
+		{
+		case '{':
+		case '[':
+		{
+			if (depth == opts.max_depth)
+				return error("nesting too deep", p);
+			if (depth == frames.size())
+				frames.emplace_back();
+			frame &f = frames[depth++];
+			f.is_object = *p == '{';
+			f.packed = !f.is_object && opts.pack_numbers;
+			f.layout = 0;
+			f.unshaped = false;
+			// A parse that failed leaves its frames filled.
+			f.obj.clear();
+			f.arr.clear();
+			f.nums.clear();
+			f.values.clear();
+			if (depth == 1)
+			{
+				f.projected = proj != nullptr;
+				f.node = 0;
+			}
+			else
+			{
+				// Elements of a projected array are projected like the
+				// array; members only if they were descended into.
+				const frame &parent = frames[depth - 2];
+				f.projected = parent.projected && (!parent.is_object || parent.child != npos);
+				f.node = parent.is_object ? parent.child : parent.node;
+			}
+			// An array only on the way to selected members keeps just its
+			// containers.
+			f.descended = f.projected && depth > 1 && (frames[depth - 2].is_object || frames[depth - 2].descended);
+			if (f.descended && !f.is_object)
+				f.packed = false;
+			char close = f.is_object ? '}' : ']';
+
+			++p;
+			skip_space();
+			if (*p == close)
+			{
+				++p;
+				--depth;
+				v = f.is_object ? json_value::object_instance(json::object()) : json_value::array_instance(json::array());
+				break;
+			}
+			if (f.is_object)
+			{
+				bool closed;
+				if (!next_member(f, depth, closed))
+					return json_value::error_instance();
+				if (closed)
+				{
+					--depth;
+					v = json_value::object_instance(json::object());
+					break;
+				}
+			}
+			continue;
+		}
+		case 't':
+		case 'f':
+		case 'n':
+			v = parse_literal();
+			break;
+		case '\"':
+			v = parse_string();
+			break;
+		case '\0':
+			if (depth == 0)
+				return shared_ptr<json_value>();
+			return error("unexpected end of input", p);
+		default:
+			if (depth != 0 && frames[depth - 1].packed)
+			{
+				double num;
+				if (!parse_number_raw(num))
+					return json_value::error_instance();
+				frames[depth - 1].nums.push_back(num);
+				v.reset();
+				break;
+			}
+			v = parse_number();
+			break;
+		}
+
+		if (v && v->type() == json::json_type::ERROR)
+			return v;
+
+		// Hand the finished value to the enclosing container; when that
+		// closes as well, keep going outwards.
+		for (;;)
+		{
+			if (v && opts.dedup)
+				v = interned.intern(std::move(v));
+			if (depth == 0)
+				return v;
+
+			frame &f = frames[depth - 1];
+			size_t layout = f.is_object && opts.shapes && !f.unshaped ? shapes.step(f.layout, f.key) : shape_registry::npos;
+			if (layout != shape_registry::npos)
+			{
+				f.layout = layout;
+				f.values.push_back(std::move(v));
+			}
+			else if (f.is_object)
+			{
+				if (opts.shapes && !f.unshaped)
+				{
+					f.obj = shapes.members(f.layout, std::move(f.values));
+					f.values.clear();
+					f.unshaped = true;
+				}
+				f.obj.insert(std::make_pair(std::move(f.key), std::move(v)));
+			}
+			else if (v)
+			{
+				// Not a number: box what was packed so far and carry on as
+				// an ordinary array.
+				if (f.packed)
+				{
+					f.arr.reserve(f.nums.size() + 1);
+					for (double num : f.nums)
+					{
+						shared_ptr<json_value> boxed = json_value::number_instance(num);
+						f.arr.push_back(opts.dedup ? interned.intern(std::move(boxed)) : std::move(boxed));
+					}
+					f.nums.clear();
+					f.packed = false;
+				}
+				f.arr.push_back(std::move(v));
+			}
+
+			skip_space();
+			char c = *p++;
+			if (c == ',')
+			{
+				if (!f.is_object)
+					break;
+				bool closed;
+				if (!next_member(f, depth, closed))
+					return json_value::error_instance();
+				if (!closed)
+					break;
+				c = '}';
+			}
+			if (c == (f.is_object ? '}' : ']'))
+			{
+				if (f.is_object && opts.shapes && !f.unshaped)
+				{
+					v = f.values.empty() ? json_value::object_instance(json::object()) : shapes.make(f.layout, std::move(f.values));
+					f.values.clear();
+				}
+				else if (f.is_object)
+				{
+					v = json_value::object_instance(std::move(f.obj));
+					f.obj.clear();
+				}
+				else if (f.packed)
+				{
+					v = json_value::array_instance(std::move(f.nums));
+					f.nums.clear();
+				}
+				else
+				{
+					v = json_value::array_instance(std::move(f.arr));
+					f.arr.clear();
+				}
+				--depth;
+				continue;
+			}
+			return error(f.is_object ? "expected ',' or '}'" : "expected ',' or ']'", p - 1);
+		}
+	}
+}
+
+quarkson::projection::projection(const vector<string> &paths)
+{
+	nodes.emplace_back();
+	for (const string &path : paths)
+	{
+		size_t n = 0;
+		size_t from = 0;
+		for (;;)
+		{
+			size_t dot = path.find('.', from);
+			string name = path.substr(from, dot == string::npos ? string::npos : dot - from);
+			auto it = std::find_if(nodes[n].children.begin(), nodes[n].children.end(),
+				[&](const std::pair<string, size_t> &c) { return c.first == name; });
+			if (it != nodes[n].children.end())
+				n = it->second;
+			else
+			{
+				nodes[n].children.emplace_back(std::move(name), nodes.size());
+				n = nodes.size();
+				nodes.emplace_back();
+			}
+			if (dot == string::npos)
+				break;
+			from = dot + 1;
+		}
+		nodes[n].selected = true;
+	}
+}
+
+quarkson::projection::projection(predicate pred) : pred(std::move(pred))
+{
+}
+
+quarkson::projection::action quarkson::projection::visit(size_t node, string_view name, size_t &child) const
+{
+	for (const auto &c : nodes[node].children)
+		if (c.first == name)
+		{
+			child = c.second;
+			return nodes[child].selected ? action::INCLUDE : action::DESCEND;
+		}
+	return action::SKIP;
+}
+
+size_t quarkson::shape_registry::step(size_t node, const string &name)
+{
+	path_node &from = nodes[node];
+	if (from.last != 0 && nodes[from.last].name == name)
+		return from.last;
+
+	auto it = from.children.find(name);
+	if (it != from.children.end())
+		return from.last = it->second;
+	if (from.children.size() >= max_branches || nodes.size() > max_nodes)
+		return npos;
+
+	size_t child = nodes.size();
+	nodes.emplace_back();
+	nodes.back().parent = node;
+	nodes.back().name = name;
+	from.children.emplace(nodes.back().name, child);
+	return from.last = child;
+}
+
+vector<string> quarkson::shape_registry::names(size_t node) const
+{
+	vector<string> out;
+	for (; node != 0; node = nodes[node].parent)
+		out.push_back(nodes[node].name);
+	std::reverse(out.begin(), out.end());
+	return out;
+}
+
+shared_ptr<json_value> quarkson::shape_registry::make(size_t node, json::array &&values)
+{
+	path_node &n = nodes[node];
+	if (!n.shape && !n.plain)
+	{
+		vector<string> keys = names(node);
+		std::unordered_set<string_view> seen;
+		for (const string &k : keys)
+			if (!seen.insert(k).second)
+				n.plain = true;
+		if (!n.plain)
+			n.shape = std::make_shared<const object_shape>(std::move(keys));
+	}
+
+	if (n.shape)
+		return json_value::object_instance(n.shape, std::move(values));
+	return json_value::object_instance(members(node, std::move(values)));
+}
+
+quarkson::json::object quarkson::shape_registry::members(size_t node, json::array &&values) const
+{
+	vector<string> keys = names(node);
+	json::object obj;
+	for (size_t i = 0; i < keys.size(); ++i)
+		obj.insert(std::make_pair(std::move(keys[i]), std::move(values[i])));
+	return obj;
+}
+
+bool quarkson::parser::next_member(frame &f, size_t depth, bool &closed)
+{
+	closed = false;
+	for (;;)
+	{
+		if (!parse_key(f))
+			return fail("expected object key", p);
+		if (!f.projected)
+			return true;
+
+		projection::action act;
+		if (proj->has_predicate())
+		{
+			path.clear();
+			for (size_t i = 0; i < depth; ++i)
+				if (frames[i].is_object)
+					path.push_back(frames[i].key);
+			act = proj->visit(path);
+			f.child = 0;
+		}
+		else
+			act = proj->visit(f.node, f.key, f.child);
+
+		if (act == projection::action::INCLUDE)
+		{
+			f.child = npos;
+			return true;
+		}
+		skip_space();
+		if (act == projection::action::DESCEND && (*p == '{' || *p == '['))
+			return true;
+
+		const char *at = p;
+		if (!skip_value())
+			return fail("invalid value", at);
+		skip_space();
+		char c = *p++;
+		if (c == '}')
+		{
+			closed = true;
+			return true;
+		}
+		if (c != ',')
+			return fail("expected ',' or '}'", p - 1);
+	}
+}
+
+// Reads "key": into f.key and leaves p at the member value.
+bool quarkson::parser::parse_key(frame &f)
+{
+	skip_space();
+	if (*p != '\"')
+		return false;
+	f.key.clear();
+	if (!parse_string_raw(f.key))
+		return false;
+	skip_space();
+	if (*p++ != ':')
+		return false;
+	return true;
+}
+
+shared_ptr<json_value> quarkson::parser::parse_value_recursive()
 {
 	skip_space();
 	switch (*p)
@@ -72,7 +482,7 @@ shared_ptr<json_value> quarkson::parser::parse_object()
 			else
 				return json_value::error_instance();
 
-			shared_ptr<json_value> value = parse_value();
+			shared_ptr<json_value> value = parse_value_recursive();
 		
 			obj.insert(std::make_pair(std::move(key), std::move(value)));
 			skip_space();
@@ -108,7 +518,7 @@ shared_ptr<json_value> parser::parse_array()
 	else
 		while (*p)
 		{
-			arr.push_back(parse_value());
+			arr.push_back(parse_value_recursive());
 			skip_space();
 			char c = *p++;
 
@@ -124,23 +534,46 @@ shared_ptr<json_value> parser::parse_array()
 }
 
 shared_ptr<json_value> quarkson::parser::parse_string()
+{
+	string str;
+	if (!parse_string_raw(str))
+		return json_value::error_instance();
+	return json_value::string_instance(std::move(str));
+}
+
+bool quarkson::parser::parse_string_raw(string &str)
 {
 	const char *c = p;
 	if (*c == '\"') ++c;
-	else return json_value::error_instance();
+	else return false;
 
 	if (*c == '\"')
 	{
 		++c;
 		p = c;
-		return json_value::string_instance("");
+		return true;
 	}
-	string str;
 
-	while (*c)
+	while (c != e)
 	{
+		// Copy the plain run up to the next quote, backslash or control
+		// character in one go, validating it only if it held non-ASCII bytes.
+		bool ascii = true;
+		const char *run = c;
+		c = simd::find_string_special(c, e, ascii);
+		if (!ascii)
+		{
+			size_t bad = utf8::validate(run, c - run);
+			if (bad != static_cast<size_t>(c - run))
+				return fail("invalid UTF-8", run + bad);
+		}
+		str.append(run, c);
+		if (c == e)
+			break;
+
 		if (*c == '\\')
 		{
+			const char *esc = c;
 			++c;
 			switch (*c)
 			{
@@ -181,86 +614,194 @@ shared_ptr<json_value> quarkson::parser::parse_string()
 				unsigned int uni = 0;
 				c = parse_hex4(c, uni);
 				if (c == nullptr)
-					return json_value::error_instance();
+					return false;
+				if (uni >= 0xDC00 && uni <= 0xDFFF)
+					return fail("unpaired low surrogate", esc);
 				if (uni >= 0xD800 && uni <= 0xDBFF) 
 				{
 					unsigned int uni2 = 0;
 					if (*c++ != '\\')
-						return json_value::error_instance();
+						return fail("unpaired high surrogate", esc);
 					if (*c++ != 'u')
-						return json_value::error_instance();
+						return fail("unpaired high surrogate", esc);
 					if (!(c = parse_hex4(c, uni2)))
-						return json_value::error_instance();
+						return false;
+					if (uni2 < 0xDC00 || uni2 > 0xDFFF)
+						return fail("unpaired high surrogate", esc);
 					uni = ((uni - 0xD800) << 10 | (uni2 - 0xDC00)) + 0x10000;
 				}
 				str += encode_utf8(uni);
+				continue;
 			}
+			return false;
 		}
 		else if (*c == '\"')
 		{
 			++c;
 			p = c;
-			return json_value::string_instance(str);
+			return true;
 		}
 		else
 			str.push_back(*c++);
 	}
-	return json_value::error_instance();
+	return false;
 }
 
 shared_ptr<json_value> quarkson::parser::parse_number()
 {
+	double num;
+	if (!parse_number_raw(num))
+		return json_value::error_instance();
+	return json_value::number_instance(num);
+}
+
+const char * quarkson::parser::number_end() const
+{
+	auto digit = [](char ch) { return ch >= '0' && ch <= '9'; };
 	const char *c = p;
-	char *e;
 	if (*c == '-') ++c;
 
 	if (*c == '0') ++c;
-	else if (isdigit1to9(*c))
+	else if (*c >= '1' && *c <= '9')
 	{
 		do
 		{
 			++c;
-		} while (isdigit(*c));
+		} while (digit(*c));
 	}
-	else return json_value::error_instance();
+	else return nullptr;
 
 	if (*c == '.')
 	{
+		if (!digit(*++c))
+			return nullptr;
 		do
 		{
 			++c;
-		} while (isdigit(*c));
+		} while (digit(*c));
 	}
 
-	if (*c != 'e' || *c != 'E')
-	{
-		errno = 0;
-		double num = std::strtod(p, &e);
-		if (errno != ERANGE)
-		{
-			p = e;
-			return json_value::number_instance(num);
-		}
-		else
-			return json_value::error_instance();
-	}
-	else
+	if (*c == 'e' || *c == 'E')
 	{
+		++c;
+		if (*c == '+' || *c == '-') ++c;
+		if (!digit(*c))
+			return nullptr;
 		do
 		{
 			++c;
-		} while (isdigit(*c) || *c == '+' || *c == '-');
+		} while (digit(*c));
 	}
+	return c;
+}
 
+bool quarkson::parser::parse_number_raw(double &num)
+{
+	// strtod takes more than JSON does (hex, "0123", "1."), so the grammar
+	// is checked first and decides where the number ends.
+	const char *end = number_end();
+	if (end == nullptr)
+		return false;
 	errno = 0;
-	double num = std::strtod(p, &e);
-	if (errno != ERANGE)
+	num = std::strtod(p, nullptr);
+	if (errno == ERANGE)
+		return false;
+	p = end;
+	return true;
+}
+
+// Steps over one value without building it: strings are not unescaped,
+// numbers not converted, and containers are only bracket-matched, not
+// checked.
+bool quarkson::parser::skip_value()
+{
+	skip_space();
+	switch (*p)
+	{
+	case '\"':
+		return skip_string();
+	case '{':
+	case '[':
 	{
-		p = e;
-		return json_value::number_instance(num);
+		// Bit d of objects is set if the container at depth d is an object,
+		// so that each closer can be matched; deeper levels go to more.
+		size_t depth = 0;
+		uint64_t objects = 0;
+		vector<bool> more;
+		for (;;)
+		{
+			p = simd::find_quote_or_bracket(p, e);
+			if (p == e)
+				return false;
+			switch (*p)
+			{
+			case '\"':
+				if (!skip_string())
+					return false;
+				break;
+			case '{':
+			case '[':
+				if (depth < 64)
+					objects = (objects & ~(uint64_t(1) << depth)) | (uint64_t(*p == '{') << depth);
+				else
+					more.push_back(*p == '{');
+				++depth;
+				++p;
+				break;
+			default:
+			{
+				bool object;
+				if (--depth < 64)
+					object = (objects >> depth) & 1;
+				else
+				{
+					object = more.back();
+					more.pop_back();
+				}
+				if (*p != (object ? '}' : ']'))
+					return false;
+				++p;
+				if (depth == 0)
+					return true;
+				break;
+			}
+			}
+		}
+	}
+	case '\0':
+	case ',':
+	case ':':
+	case ']':
+	case '}':
+		return false;
+	default:
+		for (; p != e && !simd::is_space(*p) && !simd::is_op(*p); ++p);
+		return true;
+	}
+}
+
+bool quarkson::parser::skip_string()
+{
+	++p;
+	for (;;)
+	{
+		p = simd::find_string_special(p, e);
+		if (p == e)
+			return false;
+		if (*p == '\"')
+		{
+			++p;
+			return true;
+		}
+		if (*p == '\\')
+		{
+			if (e - p < 2)
+				return false;
+			p += 2;
+		}
+		else
+			++p;
 	}
-	else
-		return json_value::error_instance();
 }
 
 shared_ptr<json_value> quarkson::parser::parse_literal()
@@ -320,7 +861,7 @@ const string quarkson::parser::encode_utf8(unsigned int uni)
 	else if (uni <= 0x7FF)
 	{
 		str.push_back(0xC0 | ((uni >> 6) & 0xFF));
-		str.push_back(0x80 | uni);
+		str.push_back(0x80 | (uni & 0x3F));
 	}
 	else if (uni <= 0xFFFF)
 	{
@@ -2,26 +2,171 @@
 
 #include "json.hpp"
 
+#include <deque>
+#include <functional>
+#include <mutex>
+
 namespace quarkson {
 
+class shape_registry;
+
+struct parse_options
+{
+	// Containers nested deeper than this fail with "nesting too deep".
+	size_t max_depth = 1024;
+	// Inputs longer than this many bytes fail with "document too large".
+	size_t max_size = static_cast<size_t>(-1);
+	// Store arrays made only of numbers as one packed buffer of doubles
+	// (see json::get_numbers).
+	bool pack_numbers = true;
+	// Share equal values as they are parsed, as json::compact does.
+	bool dedup = false;
+	// Build objects whose members come in the same order on one shared
+	// object_shape, each object holding only its values.
+	bool shapes = false;
+	// Registry for shapes to use in place of one per parse, so that
+	// documents parsed apart share their shapes. Owned by the caller.
+	shape_registry *shared_shapes = nullptr;
+};
+
+// Selects the parts of a document to build. A member is addressed by the
+// names of the objects leading to it; arrays are transparent, so every
+// element of an array shares the array's path. Members outside the
+// projection are skipped unparsed and left out of the result.
+class projection
+{
+public:
+	enum class action
+	{
+		// Leave the member out.
+		SKIP,
+		// Build the member's whole value.
+		INCLUDE,
+		// Build the member only if it is an object or array, and ask again
+		// for each member below it.
+		DESCEND
+	};
+
+	// Called with the path of every member inside a descended value.
+	using predicate = std::function<action(const vector<string_view> &path)>;
+
+	// Member names separated by '.', e.g. "Image.Thumbnail.Width".
+	projection(const vector<string> &paths);
+	projection(std::initializer_list<string> paths) : projection(vector<string>(paths)) {}
+	explicit projection(predicate pred);
+
+	// Decides for member name of the object at trie node; sets child to the
+	// node of the member's own members.
+	action visit(size_t node, string_view name, size_t &child) const;
+
+	bool has_predicate() const { return static_cast<bool>(pred); }
+	action visit(const vector<string_view> &path) const { return pred(path); }
+
+private:
+	// A node per path prefix; selected nodes are whole paths.
+	struct node
+	{
+		vector<std::pair<string, size_t>> children;
+		bool selected = false;
+	};
+
+	vector<node> nodes;
+	predicate pred;
+};
+
+// The shapes met while parsing, as a tree of member names in arrival order:
+// objects that walk the same path end on the same shape. A parser has one
+// of its own unless parse_options names one to share; a shared registry is
+// held by one parse at a time.
+class shape_registry
+{
+public:
+	// Objects whose keys are data, such as maps keyed by id, would add a
+	// shape for each new key. A path branches at most max_branches ways,
+	// and the registry stops at max_nodes paths; objects past either
+	// limit are built as ordinary objects.
+	explicit shape_registry(size_t max_branches = 64, size_t max_nodes = 1 << 16) : max_branches(max_branches), max_nodes(max_nodes), nodes(1) {}
+
+	shape_registry(const shape_registry &) = delete;
+	shape_registry & operator=(const shape_registry &) = delete;
+
+	static const size_t npos = static_cast<size_t>(-1);
+
+	// Node reached from node by one more member, or npos past the limits.
+	size_t step(size_t node, const string &name);
+
+	// Object with the members along the path to node. Names that repeat
+	// along the path cannot be shaped; those give an ordinary object in
+	// which the first of each name wins.
+	shared_ptr<json_value> make(size_t node, json::array &&values);
+
+	// The members along the path to node as an ordinary object.
+	json::object members(size_t node, json::array &&values) const;
+
+	size_t size() const { return nodes.size() - 1; }
+
+private:
+	struct path_node
+	{
+		size_t parent = 0;
+		string name;
+		// Most objects of a shape take the same branch as the last one did.
+		size_t last = 0;
+		unordered_map<string_view, size_t> children;
+		shared_ptr<const object_shape> shape;
+		bool plain = false;
+	};
+
+	vector<string> names(size_t node) const;
+
+	friend class parser;
+
+	const size_t max_branches;
+	const size_t max_nodes;
+	// A deque so that children can view the names of their nodes.
+	std::deque<path_node> nodes;
+	// Held by the parse using the registry.
+	std::mutex lock;
+};
+
 class parser
 {
 public:
 	static json parse(const string&);
-	static json parse(const string&, const string&);
+	static json parse(const string&, string&);
+	static json parse(const string&, string&, const parse_options&);
+	static json parse(const string&, const projection&);
+	static json parse(const string&, string&, const parse_options&, const projection&);
 public:
-	parser(const string &str) : s(str.c_str()), p(str.c_str()) 
+	parser(const string &str, const parse_options &opts = parse_options()) : s(str.c_str()), p(str.c_str()), e(str.c_str() + str.size()), opts(opts),
+		shapes(opts.shared_shapes ? *opts.shared_shapes : own_shapes), err_offset(0) 
 	{
 		int a = 0;
 	}
+	// Over [b, e), which need not end in NUL, for skip_value() and
+	// skip_string() only; they stop at e where the rest stop at NUL.
+	parser(const char *b, const char *e, const parse_options &opts = parse_options()) : s(b), p(b), e(e), opts(opts),
+		shapes(opts.shared_shapes ? *opts.shared_shapes : own_shapes), err_offset(0) {}
 
+	// Non-recursive: containers are tracked on an explicit stack of frames,
+	// so nesting depth costs heap, not call stack.
 	shared_ptr<json_value> parse_value();
+
+	// The original recursive descent. No depth limit.
+	shared_ptr<json_value> parse_value_recursive();
 	shared_ptr<json_value> parse_object();
 	shared_ptr<json_value> parse_array();
 	shared_ptr<json_value> parse_string();
+	bool parse_string_raw(string &str);
 	shared_ptr<json_value> parse_number();
+	bool parse_number_raw(double &num);
+	// End of the number at p, or nullptr where it breaks the JSON grammar.
+	const char * number_end() const;
 	shared_ptr<json_value> parse_literal();
 
+	bool skip_value();
+	bool skip_string();
+
 	bool isdigit1to9(char ch) { return ch >= '1' ? (ch <= '9' ? true : false) : false; }
 
 	const char * parse_hex4(const char * p, unsigned int &uni);
@@ -30,8 +175,63 @@ public:
 
 	void skip_space() { for (; *p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'; ++p); }
 
+	// Parses the whole input and formats the first error into err.
+	json run(string &message);
+
+	bool fail(const char *what, const char *at);
+	shared_ptr<json_value> error(const char *what, const char *at);
+
+	struct frame
+	{
+		bool is_object;
+		// Array whose elements so far are all numbers, held in nums.
+		bool packed;
+		// Members are checked against the projection; node is the trie
+		// node of the container's path and child that of the current member.
+		bool projected;
+		size_t node;
+		size_t child;
+		// Reached through a DESCEND member rather than selected: holds only
+		// containers that may lead to selected members.
+		bool descended;
+		// With opts.shapes: the shape_registry node of the members so far
+		// and their values. Past the registry's limits the object goes on
+		// in obj instead.
+		size_t layout;
+		bool unshaped;
+		json::array values;
+		vector<double> nums;
+		json::array arr;
+		json::object obj;
+		string key;
+	};
+
+	bool parse_key(frame &f);
+
+	static const size_t npos = static_cast<size_t>(-1);
+
+	// Reads the next member of f, skipping those left out by the
+	// projection. Returns false on error; closed is set if the object
+	// ended instead.
+	bool next_member(frame &f, size_t depth, bool &closed);
+
 	const char *s;
 	const char *p;
+	const char *e;
+
+	parse_options opts;
+	vector<frame> frames;
+
+	// Used when opts.dedup is set; its stats() tell what was shared.
+	interner interned;
+	shape_registry own_shapes;
+	shape_registry &shapes;
+
+	const projection *proj = nullptr;
+	vector<string_view> path;
+
+	string err;
+	size_t err_offset;
 };
 
 }
@@ -0,0 +1,223 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(_M_X64) || defined(_M_AMD64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define QUARKSON_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace quarkson {
+namespace simd {
+
+inline unsigned ctz32(uint32_t x)
+{
+#if defined(_MSC_VER)
+	unsigned long idx;
+	_BitScanForward(&idx, x);
+	return static_cast<unsigned>(idx);
+#else
+	return static_cast<unsigned>(__builtin_ctz(x));
+#endif
+}
+
+inline bool is_space(char ch) { return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r'; }
+
+// First byte in [p, e) that is not JSON whitespace, or e.
+inline const char * skip_space(const char *p, const char *e)
+{
+	// Most documents have at most a handful of blanks between tokens, so try
+	// a few scalar steps before paying for a vector load.
+	for (int i = 0; i < 4; ++i, ++p)
+		if (p == e || !is_space(*p))
+			return p;
+#ifdef QUARKSON_SSE2
+	const __m128i sp = _mm_set1_epi8(' ');
+	const __m128i tab = _mm_set1_epi8('\t');
+	const __m128i nl = _mm_set1_epi8('\n');
+	const __m128i cr = _mm_set1_epi8('\r');
+	for (; e - p >= 16; p += 16)
+	{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+		__m128i ws = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, tab)),
+			_mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, cr)));
+		uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(ws)) ^ 0xFFFFu;
+		if (mask)
+			return p + ctz32(mask);
+	}
+#endif
+	for (; p != e && is_space(*p); ++p);
+	return p;
+}
+
+// First byte in [p, e) that ends a plain run inside a string literal: a
+// quote, a backslash or a control character (< 0x20). Returns e if none.
+// ascii is cleared if the scanned bytes may contain non-ASCII bytes (it can
+// also be cleared by bytes past the returned position).
+inline const char * find_string_special(const char *p, const char *e, bool &ascii)
+{
+#ifdef QUARKSON_SSE2
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i bslash = _mm_set1_epi8('\\');
+	// Unsigned "x < 0x20" via saturating subtract: (x -sat 0x1F) == 0.
+	const __m128i ctl = _mm_set1_epi8(0x1F);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i high = zero;
+	for (; e - p >= 16; p += 16)
+	{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+		__m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash)),
+			_mm_cmpeq_epi8(_mm_subs_epu8(v, ctl), zero));
+		high = _mm_or_si128(high, v);
+		uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(hit));
+		if (mask)
+		{
+			ascii = ascii && _mm_movemask_epi8(high) == 0;
+			return p + ctz32(mask);
+		}
+	}
+	ascii = ascii && _mm_movemask_epi8(high) == 0;
+#endif
+	for (; p != e; ++p)
+	{
+		unsigned char ch = static_cast<unsigned char>(*p);
+		if (ch == '"' || ch == '\\' || ch < 0x20)
+			return p;
+		if (ch >= 0x80)
+			ascii = false;
+	}
+	return e;
+}
+
+inline const char * find_string_special(const char *p, const char *e)
+{
+	bool ascii = true;
+	return find_string_special(p, e, ascii);
+}
+
+// First quote or bracket in [p, e), or e.
+inline const char * find_quote_or_bracket(const char *p, const char *e)
+{
+#ifdef QUARKSON_SSE2
+	for (; e - p >= 16; p += 16)
+	{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+		__m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('[')), _mm_cmpeq_epi8(v, _mm_set1_epi8(']'))),
+			_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('{')), _mm_cmpeq_epi8(v, _mm_set1_epi8('}'))));
+		hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+		uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(hit));
+		if (mask)
+			return p + ctz32(mask);
+	}
+#endif
+	for (; p != e; ++p)
+		if (*p == '"' || *p == '[' || *p == ']' || *p == '{' || *p == '}')
+			return p;
+	return e;
+}
+
+// Character classes of a 64-byte block, one bit per byte.
+struct block
+{
+	uint64_t quote;
+	uint64_t backslash;
+	uint64_t space;
+	uint64_t op;
+	uint64_t control;
+	uint64_t high;
+};
+
+inline bool is_op(char ch)
+{
+	return ch == '{' || ch == '}' || ch == '[' || ch == ']' || ch == ':' || ch == ',';
+}
+
+inline block classify(const char *p)
+{
+	block b = {};
+#ifdef QUARKSON_SSE2
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i bslash = _mm_set1_epi8('\\');
+	const __m128i ctl = _mm_set1_epi8(0x1F);
+	const __m128i zero = _mm_setzero_si128();
+	for (int i = 0; i < 4; ++i)
+	{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16 * i));
+		__m128i sp = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+			_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+		__m128i op = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('[')), _mm_cmpeq_epi8(v, _mm_set1_epi8(']'))),
+			_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('{')), _mm_cmpeq_epi8(v, _mm_set1_epi8('}'))));
+		op = _mm_or_si128(op, _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(':')), _mm_cmpeq_epi8(v, _mm_set1_epi8(','))));
+		int shift = 16 * i;
+		b.quote |= static_cast<uint64_t>(static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, quote)))) << shift;
+		b.backslash |= static_cast<uint64_t>(static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, bslash)))) << shift;
+		b.space |= static_cast<uint64_t>(static_cast<uint32_t>(_mm_movemask_epi8(sp))) << shift;
+		b.op |= static_cast<uint64_t>(static_cast<uint32_t>(_mm_movemask_epi8(op))) << shift;
+		b.control |= static_cast<uint64_t>(static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(v, ctl), zero)))) << shift;
+		b.high |= static_cast<uint64_t>(static_cast<uint32_t>(_mm_movemask_epi8(v))) << shift;
+	}
+#else
+	for (int i = 0; i < 64; ++i)
+	{
+		uint64_t bit = uint64_t(1) << i;
+		char ch = p[i];
+		if (ch == '"') b.quote |= bit;
+		if (ch == '\\') b.backslash |= bit;
+		if (is_space(ch)) b.space |= bit;
+		if (is_op(ch)) b.op |= bit;
+		if (static_cast<unsigned char>(ch) < 0x20) b.control |= bit;
+		if (static_cast<unsigned char>(ch) >= 0x80) b.high |= bit;
+	}
+#endif
+	return b;
+}
+
+inline unsigned ctz64(uint64_t x)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+	unsigned long idx;
+	_BitScanForward64(&idx, x);
+	return static_cast<unsigned>(idx);
+#elif defined(_MSC_VER)
+	return static_cast<uint32_t>(x) ? ctz32(static_cast<uint32_t>(x)) : 32 + ctz32(static_cast<uint32_t>(x >> 32));
+#else
+	return static_cast<unsigned>(__builtin_ctzll(x));
+#endif
+}
+
+// Bit i of the result is the xor of bits 0..i of x. Applied to the quote
+// mask this marks every byte from an opening quote up to (not including)
+// its closing quote.
+inline uint64_t prefix_xor(uint64_t x)
+{
+	x ^= x << 1;
+	x ^= x << 2;
+	x ^= x << 4;
+	x ^= x << 8;
+	x ^= x << 16;
+	x ^= x << 32;
+	return x;
+}
+
+// Marks the bytes escaped by an odd run of backslashes. carry holds whether
+// the first byte of the next block is escaped.
+inline uint64_t find_escaped(uint64_t backslash, uint64_t &carry)
+{
+	const uint64_t even_bits = 0x5555555555555555ULL;
+
+	backslash &= ~carry;
+	uint64_t follows_escape = backslash << 1 | carry;
+	uint64_t odd_starts = backslash & ~even_bits & ~follows_escape;
+	uint64_t even_starts = odd_starts + backslash;
+	carry = even_starts < backslash ? 1 : 0;
+	uint64_t invert_mask = even_starts << 1;
+	return (even_bits ^ invert_mask) & follows_escape;
+}
+
+}
+}
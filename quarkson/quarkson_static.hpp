@@ -0,0 +1,771 @@
+#pragma once
+
+#include "json.hpp"
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+namespace quarkson {
+
+// A string literal as a template argument.
+template <size_t N>
+struct fixed_string
+{
+	char chars[N] = {};
+
+	constexpr fixed_string(const char (&s)[N])
+	{
+		for (size_t i = 0; i < N; ++i)
+			chars[i] = s[i];
+	}
+
+	constexpr string_view view() const { return string_view(chars, N - 1); }
+};
+
+// One value of a document parsed at compile time. Strings index into the
+// document's character buffer; the children of a container are the count
+// nodes starting at first, members carrying their name in key_first and
+// key_count.
+struct static_node
+{
+	json::json_type type = json::json_type::NUL;
+	bool boolean = false;
+	double number = 0;
+	size_t first = 0;
+	size_t count = 0;
+	size_t key_first = 0;
+	size_t key_count = 0;
+};
+
+template <size_t Nodes, size_t Chars>
+struct static_document
+{
+	static_node nodes[Nodes] = {};
+	char chars[Chars == 0 ? 1 : Chars] = {};
+};
+
+// Not constexpr: reaching it while parsing a literal at compile time stops
+// the build there, with the reason in the diagnostic.
+inline void json_literal_error(const char *) {}
+
+// Parses text in a constant expression. Run once without buffers to size
+// the document, then again to fill it. Numbers are rounded to the nearest
+// double, as strtod does, and raw string bytes must be valid UTF-8.
+class static_parser
+{
+public:
+	constexpr static_parser(string_view text, static_node *nodes, char *chars)
+		: p_(text.data()), e_(text.data() + text.size()), nodes_(nodes), chars_(chars) {}
+
+	constexpr void run()
+	{
+		size_t root = reserve(1);
+		space();
+		value(root);
+		space();
+		if (p_ != e_)
+			fail("trailing characters");
+	}
+
+	size_t node_count = 0;
+	size_t char_count = 0;
+
+private:
+	constexpr void fail(const char *what)
+	{
+		if (std::is_constant_evaluated())
+			json_literal_error(what);
+	}
+
+	constexpr char peek() const { return p_ == e_ ? '\0' : *p_; }
+
+	constexpr void expect(char ch, const char *what)
+	{
+		if (peek() != ch)
+			fail(what);
+		++p_;
+	}
+
+	constexpr void space()
+	{
+		for (; p_ != e_ && (*p_ == ' ' || *p_ == '\t' || *p_ == '\n' || *p_ == '\r'); ++p_);
+	}
+
+	constexpr size_t reserve(size_t n)
+	{
+		size_t at = node_count;
+		node_count += n;
+		return at;
+	}
+
+	constexpr void put(size_t at, const static_node &n)
+	{
+		if (nodes_ != nullptr)
+			nodes_[at] = n;
+	}
+
+	constexpr void put_char(char ch)
+	{
+		if (chars_ != nullptr)
+			chars_[char_count] = ch;
+		++char_count;
+	}
+
+	constexpr void value(size_t at)
+	{
+		switch (peek())
+		{
+		case '{':
+			object(at);
+			break;
+		case '[':
+			array(at);
+			break;
+		case '\"':
+		{
+			static_node n;
+			n.type = json::json_type::STRING;
+			string_literal(n.first, n.count);
+			put(at, n);
+			break;
+		}
+		case 't':
+			literal("true", at, json::json_type::BOOLEAN, true);
+			break;
+		case 'f':
+			literal("false", at, json::json_type::BOOLEAN, false);
+			break;
+		case 'n':
+			literal("null", at, json::json_type::NUL, false);
+			break;
+		case '\0':
+			fail("unexpected end of input");
+			break;
+		default:
+			number(at);
+			break;
+		}
+	}
+
+	constexpr void literal(string_view word, size_t at, json::json_type type, bool b)
+	{
+		if (static_cast<size_t>(e_ - p_) < word.size() || string_view(p_, word.size()) != word)
+			fail("invalid value");
+		p_ += word.size();
+		static_node n;
+		n.type = type;
+		n.boolean = b;
+		put(at, n);
+	}
+
+	// Direct children of the container at p_, counted by commas at its own
+	// level. Validation is left to the pass that reads them.
+	constexpr size_t count_children() const
+	{
+		const char *c = p_ + 1;
+		for (; c != e_ && (*c == ' ' || *c == '\t' || *c == '\n' || *c == '\r'); ++c);
+		if (c == e_ || *c == ']' || *c == '}')
+			return 0;
+
+		size_t n = 1;
+		size_t depth = 1;
+		bool in_string = false;
+		for (; c != e_; ++c)
+		{
+			if (in_string)
+			{
+				if (*c == '\\' && c + 1 != e_)
+					++c;
+				else if (*c == '\"')
+					in_string = false;
+			}
+			else if (*c == '\"')
+				in_string = true;
+			else if (*c == '[' || *c == '{')
+				++depth;
+			else if (*c == ']' || *c == '}')
+			{
+				if (--depth == 0)
+					break;
+			}
+			else if (*c == ',' && depth == 1)
+				++n;
+		}
+		return n;
+	}
+
+	constexpr void array(size_t at)
+	{
+		static_node n;
+		n.type = json::json_type::ARRAY;
+		n.count = count_children();
+		n.first = reserve(n.count);
+		put(at, n);
+
+		++p_;
+		space();
+		for (size_t i = 0; i < n.count; ++i)
+		{
+			if (i != 0)
+			{
+				expect(',', "expected ',' or ']'");
+				space();
+			}
+			value(n.first + i);
+			space();
+		}
+		expect(']', "expected ',' or ']'");
+	}
+
+	constexpr void object(size_t at)
+	{
+		static_node n;
+		n.type = json::json_type::OBJECT;
+		n.count = count_children();
+		n.first = reserve(n.count);
+		put(at, n);
+
+		++p_;
+		space();
+		for (size_t i = 0; i < n.count; ++i)
+		{
+			if (i != 0)
+			{
+				expect(',', "expected ',' or '}'");
+				space();
+			}
+			if (peek() != '\"')
+				fail("expected object key");
+			size_t key_first = 0, key_count = 0;
+			string_literal(key_first, key_count);
+			space();
+			expect(':', "expected ':'");
+			space();
+			value(n.first + i);
+			if (nodes_ != nullptr)
+			{
+				nodes_[n.first + i].key_first = key_first;
+				nodes_[n.first + i].key_count = key_count;
+			}
+			space();
+		}
+		expect('}', "expected ',' or '}'");
+	}
+
+	constexpr unsigned hex4()
+	{
+		unsigned u = 0;
+		for (int i = 0; i < 4; ++i, ++p_)
+		{
+			char ch = peek();
+			u <<= 4;
+			if (ch >= '0' && ch <= '9') u |= ch - '0';
+			else if (ch >= 'A' && ch <= 'F') u |= ch - ('A' - 10);
+			else if (ch >= 'a' && ch <= 'f') u |= ch - ('a' - 10);
+			else fail("invalid unicode hex");
+		}
+		return u;
+	}
+
+	constexpr void put_utf8(unsigned u)
+	{
+		if (u < 0x80)
+			put_char(static_cast<char>(u));
+		else if (u < 0x800)
+		{
+			put_char(static_cast<char>(0xC0 | (u >> 6)));
+			put_char(static_cast<char>(0x80 | (u & 0x3F)));
+		}
+		else if (u < 0x10000)
+		{
+			put_char(static_cast<char>(0xE0 | (u >> 12)));
+			put_char(static_cast<char>(0x80 | ((u >> 6) & 0x3F)));
+			put_char(static_cast<char>(0x80 | (u & 0x3F)));
+		}
+		else
+		{
+			put_char(static_cast<char>(0xF0 | (u >> 18)));
+			put_char(static_cast<char>(0x80 | ((u >> 12) & 0x3F)));
+			put_char(static_cast<char>(0x80 | ((u >> 6) & 0x3F)));
+			put_char(static_cast<char>(0x80 | (u & 0x3F)));
+		}
+	}
+
+	// Copies the raw UTF-8 sequence that lead starts. Overlong forms,
+	// surrogates and code points above U+10FFFF are invalid, as at run time.
+	constexpr void utf8_sequence(unsigned char lead)
+	{
+		int more = lead >= 0xF0 ? 3 : lead >= 0xE0 ? 2 : 1;
+		if (lead < 0xC2 || lead > 0xF4)
+			fail("invalid UTF-8");
+		unsigned u = lead & (0x3F >> more);
+		put_char(static_cast<char>(lead));
+		for (int i = 0; i < more; ++i, ++p_)
+		{
+			unsigned char ch = static_cast<unsigned char>(peek());
+			if ((ch & 0xC0) != 0x80)
+			{
+				fail("invalid UTF-8");
+				return;
+			}
+			u = u << 6 | (ch & 0x3F);
+			put_char(static_cast<char>(ch));
+		}
+		if ((more == 2 && (u < 0x800 || (u >= 0xD800 && u <= 0xDFFF))) || (more == 3 && (u < 0x10000 || u > 0x10FFFF)))
+			fail("invalid UTF-8");
+	}
+
+	constexpr void string_literal(size_t &first, size_t &count)
+	{
+		first = char_count;
+		++p_;
+		for (;;)
+		{
+			if (p_ == e_)
+				fail("missing quotation mark");
+			char ch = *p_++;
+			if (ch == '\"')
+				break;
+			if (static_cast<unsigned char>(ch) < 0x20)
+				fail("invalid string char");
+			if (static_cast<unsigned char>(ch) >= 0x80)
+			{
+				utf8_sequence(static_cast<unsigned char>(ch));
+				continue;
+			}
+			if (ch != '\\')
+			{
+				put_char(ch);
+				continue;
+			}
+			switch (peek())
+			{
+			case '\"': put_char('\"'); break;
+			case '\\': put_char('\\'); break;
+			case '/': put_char('/'); break;
+			case 'b': put_char('\b'); break;
+			case 'f': put_char('\f'); break;
+			case 'n': put_char('\n'); break;
+			case 'r': put_char('\r'); break;
+			case 't': put_char('\t'); break;
+			case 'u':
+			{
+				++p_;
+				unsigned u = hex4();
+				if (u >= 0xDC00 && u <= 0xDFFF)
+					fail("unpaired low surrogate");
+				if (u >= 0xD800 && u <= 0xDBFF)
+				{
+					if (peek() != '\\' || p_ + 1 == e_ || p_[1] != 'u')
+						fail("unpaired high surrogate");
+					p_ += 2;
+					unsigned low = hex4();
+					if (low < 0xDC00 || low > 0xDFFF)
+						fail("unpaired high surrogate");
+					u = 0x10000 + ((u - 0xD800) << 10) + (low - 0xDC00);
+				}
+				put_utf8(u);
+				continue;
+			}
+			default:
+				fail("invalid string escape");
+			}
+			++p_;
+		}
+		count = char_count - first;
+	}
+
+	static constexpr bool is_digit(char ch) { return ch >= '0' && ch <= '9'; }
+
+	// Significant digits kept. The halfway point between two doubles has
+	// fewer than this, so the digits dropped past it only break ties.
+	static constexpr int MAX_DIGITS = 800;
+
+	// digits * 10^exp10, without leading or trailing zeros.
+	struct decimal
+	{
+		char digits[MAX_DIGITS] = {};
+		int count = 0;
+		int exp10 = 0;
+		// Nonzero digits were dropped past MAX_DIGITS.
+		bool truncated = false;
+	};
+
+	constexpr void number(size_t at)
+	{
+		bool negative = false;
+		if (peek() == '-')
+		{
+			negative = true;
+			++p_;
+		}
+
+		decimal d;
+		auto digit = [&](char ch, bool fraction)
+		{
+			if (d.count == 0 && ch == '0')
+			{
+				if (fraction)
+					--d.exp10;
+			}
+			else if (d.count < MAX_DIGITS)
+			{
+				d.digits[d.count++] = ch;
+				if (fraction)
+					--d.exp10;
+			}
+			else
+			{
+				if (!fraction)
+					++d.exp10;
+				if (ch != '0')
+					d.truncated = true;
+			}
+		};
+
+		if (peek() == '0')
+			++p_;
+		else if (is_digit(peek()))
+			for (; is_digit(peek()); ++p_)
+				digit(*p_, false);
+		else
+			fail("invalid value");
+
+		if (peek() == '.')
+		{
+			++p_;
+			if (!is_digit(peek()))
+				fail("invalid value");
+			for (; is_digit(peek()); ++p_)
+				digit(*p_, true);
+		}
+
+		if (peek() == 'e' || peek() == 'E')
+		{
+			++p_;
+			bool exp_negative = false;
+			if (peek() == '+' || peek() == '-')
+				exp_negative = *p_++ == '-';
+			if (!is_digit(peek()))
+				fail("invalid value");
+			int e = 0;
+			for (; is_digit(peek()); ++p_)
+				if (e < 100000)
+					e = e * 10 + (*p_ - '0');
+			d.exp10 += exp_negative ? -e : e;
+		}
+		for (; d.count != 0 && d.digits[d.count - 1] == '0'; --d.count)
+			++d.exp10;
+
+		static_node n;
+		n.type = json::json_type::NUMBER;
+		// Only the pass that fills the document pays for the conversion.
+		if (nodes_ != nullptr)
+			n.number = to_double(d);
+		if (negative)
+			n.number = -n.number;
+		put(at, n);
+	}
+
+	// 10^k for 0 <= k <= 308. Up to 1e22 the powers are exact doubles;
+	// beyond, a product of at most nine correctly rounded powers.
+	static constexpr double pow10(int k)
+	{
+		constexpr double exact[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+			1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+		constexpr double squares[] = { 1e1, 1e2, 1e4, 1e8, 1e16, 1e32, 1e64, 1e128, 1e256 };
+		if (k <= 22)
+			return exact[k];
+		double r = 1;
+		for (int i = 0; k != 0; ++i, k >>= 1)
+			if (k & 1)
+				r *= squares[i];
+		return r;
+	}
+
+	// m * 10^e for an integral m, to within a few ulps; the largest double
+	// where that would overflow.
+	static constexpr double approximate(double m, int e)
+	{
+		const double MAX = 1.7976931348623157e308;
+		if (e >= 0)
+			return e > 308 || m > MAX / pow10(e) ? MAX : m * pow10(e);
+		if (e >= -308)
+			return m / pow10(-e);
+		// Two steps so that only the last one lands among the subnormals.
+		m /= pow10(308);
+		e += 308;
+		return e < -308 ? 0 : m / pow10(-e);
+	}
+
+	// Unsigned integer of up to 4096 bits, enough for any decimal of
+	// MAX_DIGITS digits in the double range scaled to a power of two.
+	struct big
+	{
+		uint32_t limbs[128] = {};
+		size_t size = 0;
+
+		constexpr void multiply(uint32_t x, uint32_t add = 0)
+		{
+			uint64_t carry = add;
+			for (size_t i = 0; i < size; ++i)
+			{
+				carry += static_cast<uint64_t>(limbs[i]) * x;
+				limbs[i] = static_cast<uint32_t>(carry);
+				carry >>= 32;
+			}
+			if (carry != 0)
+				limbs[size++] = static_cast<uint32_t>(carry);
+		}
+
+		constexpr void multiply_pow10(int e)
+		{
+			for (; e >= 9; e -= 9)
+				multiply(1000000000);
+			uint32_t x = 1;
+			for (; e > 0; --e)
+				x *= 10;
+			multiply(x);
+		}
+
+		constexpr void shift_left(int bits)
+		{
+			size_t words = static_cast<size_t>(bits) / 32;
+			int rest = bits % 32;
+			if (size == 0)
+				return;
+			limbs[size + words] = 0;
+			for (size_t i = size; i-- > 0; )
+			{
+				if (rest != 0)
+					limbs[i + words + 1] |= limbs[i] >> (32 - rest);
+				limbs[i + words] = limbs[i] << rest;
+			}
+			for (size_t i = 0; i < words; ++i)
+				limbs[i] = 0;
+			size += words + 1;
+			if (limbs[size - 1] == 0)
+				--size;
+		}
+
+		friend constexpr int compare(const big &a, const big &b)
+		{
+			if (a.size != b.size)
+				return a.size < b.size ? -1 : 1;
+			for (size_t i = a.size; i-- > 0; )
+				if (a.limbs[i] != b.limbs[i])
+					return a.limbs[i] < b.limbs[i] ? -1 : 1;
+			return 0;
+		}
+	};
+
+	// Sign of the exact d minus the point halfway between m * 2^k and the
+	// next double up.
+	static constexpr int compare_halfway(const big &digits, const decimal &d, uint64_t m, int k)
+	{
+		big x = digits, half;
+		half.limbs[0] = static_cast<uint32_t>(2 * m + 1);
+		half.limbs[1] = static_cast<uint32_t>((2 * m + 1) >> 32);
+		half.size = half.limbs[1] != 0 ? 2 : 1;
+		if (d.exp10 >= 0)
+			x.multiply_pow10(d.exp10);
+		else
+			half.multiply_pow10(-d.exp10);
+		if (k >= 1)
+			half.shift_left(k - 1);
+		else
+			x.shift_left(1 - k);
+		return compare(x, half);
+	}
+
+	// Correctly rounded to nearest, ties to even: exact when the digits and
+	// the power of ten are, otherwise an estimate moved an ulp at a time
+	// until the exact value lies within half an ulp of it.
+	constexpr double to_double(const decimal &d)
+	{
+		const uint64_t HIDDEN = uint64_t(1) << 52;
+		if (d.count == 0)
+			return 0;
+		// The value is below 10^lead.
+		int lead = d.count + d.exp10;
+		if (lead > 310)
+		{
+			fail("number too big");
+			return 0;
+		}
+		if (lead < -324)
+			return 0;
+
+		int used = d.count < 19 ? d.count : 19;
+		uint64_t mantissa = 0;
+		for (int i = 0; i < used; ++i)
+			mantissa = mantissa * 10 + static_cast<uint64_t>(d.digits[i] - '0');
+		if (d.count <= 15 && d.exp10 >= -22 && d.exp10 <= 22)
+			return d.exp10 >= 0 ? mantissa * pow10(d.exp10) : mantissa / pow10(-d.exp10);
+
+		uint64_t bits = std::bit_cast<uint64_t>(approximate(static_cast<double>(mantissa), d.exp10 + d.count - used));
+		uint64_t m = bits & (HIDDEN - 1);
+		int k = -1074;
+		if ((bits >> 52) != 0)
+		{
+			m |= HIDDEN;
+			k = static_cast<int>(bits >> 52) - 1075;
+		}
+
+		big digits;
+		for (int i = 0; i < d.count; ++i)
+			digits.multiply(10, static_cast<uint32_t>(d.digits[i] - '0'));
+		for (;;)
+		{
+			int c = compare_halfway(digits, d, m, k);
+			if (c < 0 || (c == 0 && !d.truncated && (m & 1) == 0))
+				break;
+			if (++m == 2 * HIDDEN)
+			{
+				m = HIDDEN;
+				++k;
+			}
+		}
+		while (m != 0)
+		{
+			uint64_t down = m - 1;
+			int down_k = k;
+			if (m == HIDDEN && k > -1074)
+			{
+				down = 2 * HIDDEN - 1;
+				--down_k;
+			}
+			int c = compare_halfway(digits, d, down, down_k);
+			if (c > 0 || (c == 0 && (d.truncated || (m & 1) == 0)))
+				break;
+			m = down;
+			k = down_k;
+		}
+
+		if (k > 971)
+		{
+			fail("number too big");
+			return 0;
+		}
+		return std::bit_cast<double>(m < HIDDEN ? m : (static_cast<uint64_t>(k + 1075) << 52) | (m - HIDDEN));
+	}
+
+	const char *p_;
+	const char *e_;
+	static_node *nodes_;
+	char *chars_;
+};
+
+// Read-only view of a value in a compile-time document. Everything but
+// to_json() works in constant expressions.
+class static_json
+{
+public:
+	constexpr static_json() = default;
+	constexpr static_json(const static_node *nodes, const char *chars, size_t i) : nodes_(nodes), chars_(chars), i_(i) {}
+
+	// False for the result of find() on a missing member.
+	constexpr explicit operator bool() const { return nodes_ != nullptr; }
+
+	constexpr json::json_type type() const { return node().type; }
+
+	constexpr bool get_boolean() const { return node().boolean; }
+	constexpr double get_number() const { return node().number; }
+	constexpr string_view get_string() const { return string_view(chars_ + node().first, node().count); }
+
+	// Elements of an array or members of an object.
+	constexpr size_t size() const { return node().count; }
+	constexpr static_json operator[](size_t i) const { return static_json(nodes_, chars_, node().first + i); }
+	constexpr string_view key(size_t i) const
+	{
+		const static_node &member = nodes_[node().first + i];
+		return string_view(chars_ + member.key_first, member.key_count);
+	}
+
+	// Member by name; members are few in embedded documents, so this is a
+	// linear scan.
+	constexpr static_json find(string_view name) const
+	{
+		for (size_t i = 0; i < size(); ++i)
+			if (key(i) == name)
+				return (*this)[i];
+		return static_json();
+	}
+
+	// Copies the value into an ordinary DOM.
+	json to_json() const { return json(to_value()); }
+
+private:
+	constexpr const static_node & node() const { return nodes_[i_]; }
+
+	shared_ptr<json_value> to_value() const
+	{
+		switch (type())
+		{
+		case json::json_type::OBJECT:
+		{
+			json::object obj;
+			for (size_t i = 0; i < size(); ++i)
+				obj.emplace(string(key(i)), (*this)[i].to_value());
+			return json_value::object_instance(std::move(obj));
+		}
+		case json::json_type::ARRAY:
+		{
+			json::array arr;
+			arr.reserve(size());
+			for (size_t i = 0; i < size(); ++i)
+				arr.push_back((*this)[i].to_value());
+			return json_value::array_instance(std::move(arr));
+		}
+		case json::json_type::NUMBER:
+			return json_value::number_instance(get_number());
+		case json::json_type::STRING:
+			return json_value::string_instance(string(get_string()));
+		case json::json_type::BOOLEAN:
+			return json_value::bool_instance(get_boolean());
+		default:
+			return json_value::null_instance();
+		}
+	}
+
+	const static_node *nodes_ = nullptr;
+	const char *chars_ = nullptr;
+	size_t i_ = 0;
+};
+
+template <fixed_string S>
+consteval auto parse_static()
+{
+	constexpr auto sizes = []
+	{
+		static_parser sizing(S.view(), nullptr, nullptr);
+		sizing.run();
+		return std::pair<size_t, size_t>(sizing.node_count, sizing.char_count);
+	}();
+
+	static_document<sizes.first, sizes.second> doc;
+	static_parser p(S.view(), doc.nodes, doc.chars);
+	p.run();
+	return doc;
+}
+
+// The document for S, laid out once in read-only storage.
+template <fixed_string S>
+inline constexpr auto static_document_v = parse_static<S>();
+
+namespace literals {
+
+// R"({ "a": [1, 2] })"_qjson is parsed by the compiler; a malformed
+// literal does not compile.
+template <fixed_string S>
+constexpr static_json operator""_qjson()
+{
+	return static_json(static_document_v<S>.nodes, static_document_v<S>.chars, 0);
+}
+
+}
+
+}
@@ -0,0 +1,664 @@
+#include "quarkson_stream.hpp"
+#include "quarkson_simd.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <istream>
+#include <mutex>
+#include <thread>
+
+#ifdef QUARKSON_HAS_ZLIB
+#include <zlib.h>
+#endif
+#ifdef QUARKSON_HAS_ZSTD
+#include <zstd.h>
+#endif
+
+namespace quarkson {
+
+namespace {
+
+// Blocks on their way from the decompressing thread to the parsing one.
+// Blocks the parser is done with come back for reuse.
+class block_queue
+{
+public:
+	explicit block_queue(size_t capacity) : capacity_(capacity) {}
+
+	// Waits while the queue is full. False once the parser has given up.
+	bool push(string &&block)
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		not_full_.wait(lock, [this] { return full_.size() < capacity_ || cancelled_; });
+		if (cancelled_)
+			return false;
+		full_.push_back(std::move(block));
+		not_empty_.notify_one();
+		return true;
+	}
+
+	// No more blocks follow; err is empty at the regular end.
+	void close(const string &err)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		closed_ = true;
+		err_ = err;
+		not_empty_.notify_one();
+	}
+
+	// Replaces block by the next one. False once all have been taken.
+	bool pop(string &block)
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		not_empty_.wait(lock, [this] { return !full_.empty() || closed_; });
+		if (block.capacity() != 0)
+		{
+			block.clear();
+			free_.push_back(std::move(block));
+		}
+		if (full_.empty())
+			return false;
+		block = std::move(full_.front());
+		full_.pop_front();
+		not_full_.notify_one();
+		return true;
+	}
+
+	// A buffer to fill, reused if there is one.
+	string take()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (free_.empty())
+			return string();
+		string block = std::move(free_.back());
+		free_.pop_back();
+		return block;
+	}
+
+	void cancel()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		cancelled_ = true;
+		not_full_.notify_one();
+	}
+
+	string error()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		return err_;
+	}
+
+private:
+	const size_t capacity_;
+	std::mutex mutex_;
+	std::condition_variable not_empty_;
+	std::condition_variable not_full_;
+	std::deque<string> full_;
+	vector<string> free_;
+	bool closed_ = false;
+	bool cancelled_ = false;
+	string err_;
+};
+
+// The decompressed input, a block at a time. head holds the bytes already
+// read from in to tell the format.
+class source
+{
+public:
+	source(std::istream &in, string &&head, size_t block_size) : in_(in), buf_(std::move(head)), pending_(!buf_.empty()), block_size_(block_size) {}
+	virtual ~source() = default;
+
+	// Fills block with up to block_size bytes, none at the end. False on
+	// error.
+	virtual bool next(string &block, string &err) = 0;
+
+protected:
+	// Makes buf_ the next input: head first, then reads from in_. False at
+	// the end of the input.
+	bool refill()
+	{
+		if (pending_)
+		{
+			pending_ = false;
+			return true;
+		}
+		buf_.resize(block_size_);
+		in_.read(&buf_[0], static_cast<std::streamsize>(buf_.size()));
+		buf_.resize(static_cast<size_t>(in_.gcount()));
+		return !buf_.empty();
+	}
+
+	std::istream &in_;
+	string buf_;
+	bool pending_;
+	const size_t block_size_;
+};
+
+class raw_source : public source
+{
+public:
+	using source::source;
+
+	virtual bool next(string &block, string &err)
+	{
+		block.clear();
+		if (pending_)
+		{
+			block.swap(buf_);
+			pending_ = false;
+		}
+		size_t n = block.size();
+		block.resize(std::max(block_size_, n));
+		in_.read(&block[0] + n, static_cast<std::streamsize>(block.size() - n));
+		block.resize(n + static_cast<size_t>(in_.gcount()));
+		if (in_.bad())
+		{
+			err = "read error";
+			return false;
+		}
+		return true;
+	}
+};
+
+#ifdef QUARKSON_HAS_ZLIB
+// gzip, also several members one after another as cat makes them, or zlib.
+class gzip_source : public source
+{
+public:
+	gzip_source(std::istream &in, string &&head, size_t block_size) : source(in, std::move(head), block_size)
+	{
+		z_ = {};
+		ready_ = inflateInit2(&z_, 15 + 32) == Z_OK;
+	}
+
+	virtual ~gzip_source()
+	{
+		if (ready_)
+			inflateEnd(&z_);
+	}
+
+	virtual bool next(string &block, string &err)
+	{
+		if (!ready_)
+		{
+			err = "cannot initialize zlib";
+			return false;
+		}
+		block.resize(block_size_);
+		z_.next_out = reinterpret_cast<Bytef *>(&block[0]);
+		z_.avail_out = static_cast<uInt>(block.size());
+		while (z_.avail_out != 0)
+		{
+			if (z_.avail_in == 0 && !eof_)
+			{
+				if (refill())
+				{
+					z_.next_in = reinterpret_cast<Bytef *>(&buf_[0]);
+					z_.avail_in = static_cast<uInt>(buf_.size());
+					if (ended_)
+					{
+						inflateReset(&z_);
+						ended_ = false;
+					}
+				}
+				else
+					eof_ = true;
+			}
+			if (eof_ && ended_)
+				break;
+
+			uInt before = z_.avail_out;
+			int r = inflate(&z_, Z_NO_FLUSH);
+			if (r == Z_STREAM_END)
+			{
+				// Another member may follow in the same buffer.
+				if (z_.avail_in != 0)
+					inflateReset(&z_);
+				else
+					ended_ = true;
+			}
+			else if (r != Z_OK && r != Z_BUF_ERROR)
+			{
+				err = "invalid gzip data";
+				return false;
+			}
+			else if (eof_ && z_.avail_out == before)
+			{
+				err = "truncated gzip data";
+				return false;
+			}
+		}
+		if (in_.bad())
+		{
+			err = "read error";
+			return false;
+		}
+		block.resize(block.size() - z_.avail_out);
+		return true;
+	}
+
+private:
+	z_stream z_;
+	bool ready_;
+	bool ended_ = false;
+	bool eof_ = false;
+};
+#endif
+
+#ifdef QUARKSON_HAS_ZSTD
+// One or more zstd frames.
+class zstd_source : public source
+{
+public:
+	zstd_source(std::istream &in, string &&head, size_t block_size) : source(in, std::move(head), block_size), ds_(ZSTD_createDStream())
+	{
+		if (ds_ != nullptr)
+			ZSTD_initDStream(ds_);
+	}
+
+	virtual ~zstd_source() { ZSTD_freeDStream(ds_); }
+
+	virtual bool next(string &block, string &err)
+	{
+		if (ds_ == nullptr)
+		{
+			err = "cannot initialize zstd";
+			return false;
+		}
+		block.resize(block_size_);
+		ZSTD_outBuffer out = { &block[0], block.size(), 0 };
+		while (out.pos < out.size)
+		{
+			if (in_buf_.pos == in_buf_.size && !eof_)
+			{
+				if (refill())
+					in_buf_ = { buf_.data(), buf_.size(), 0 };
+				else
+					eof_ = true;
+			}
+			if (eof_ && frame_done_)
+				break;
+
+			size_t before = out.pos;
+			size_t r = ZSTD_decompressStream(ds_, &out, &in_buf_);
+			if (ZSTD_isError(r))
+			{
+				err = string("invalid zstd data: ") + ZSTD_getErrorName(r);
+				return false;
+			}
+			frame_done_ = r == 0;
+			if (eof_ && !frame_done_ && out.pos == before)
+			{
+				err = "truncated zstd data";
+				return false;
+			}
+		}
+		if (in_.bad())
+		{
+			err = "read error";
+			return false;
+		}
+		block.resize(out.pos);
+		return true;
+	}
+
+private:
+	ZSTD_DStream *ds_;
+	ZSTD_inBuffer in_buf_ = { nullptr, 0, 0 };
+	bool frame_done_ = false;
+	bool eof_ = false;
+};
+#endif
+
+// Cuts the text into records as it arrives and parses each once complete.
+// Only record boundaries are tracked here: nesting, and strings so that
+// their brackets don't count. The parser checks everything else.
+class record_splitter
+{
+public:
+	record_splitter(const record_stream::callback &f, const parse_options &opts, record_layout layout)
+		: f_(f), opts_(opts), layout_(layout), state_(layout == record_layout::SEQUENCE ? state::SEQUENCE : state::START)
+	{
+		// Records share their shapes, as the elements of one parsed array do.
+		if (opts_.shapes && opts_.shared_shapes == nullptr)
+			opts_.shared_shapes = &shapes_;
+	}
+
+	// False on error or once the callback has stopped the stream.
+	bool feed(const char *b, const char *e)
+	{
+		base_ = b;
+		for (const char *q = b; ; )
+		{
+			if (kind_ != kind::NONE)
+			{
+				bool complete;
+				const char *end = scan(q, e, complete);
+				rec_.append(q, end);
+				q = end;
+				if (!complete)
+					break;
+				if (!emit())
+					return false;
+				continue;
+			}
+			q = simd::skip_space(q, e);
+			if (q == e)
+				break;
+			if (!step(q))
+				return false;
+		}
+		offset_ += e - b;
+		return true;
+	}
+
+	// At the end of the input.
+	bool finish()
+	{
+		base_ = nullptr;
+		if (kind_ == kind::SCALAR && !emit())
+			return false;
+		if (kind_ != kind::NONE || state_ == state::FIRST || state_ == state::ELEMENT || state_ == state::NEXT
+			|| (state_ == state::START && layout_ == record_layout::ARRAY))
+			return fail("unexpected end of input", nullptr);
+		return true;
+	}
+
+	string err;
+	bool stopped = false;
+
+private:
+	enum class state
+	{
+		START,
+		// In the top-level array: before the first element, after a comma,
+		// after an element.
+		FIRST,
+		ELEMENT,
+		NEXT,
+		DONE,
+		// Not in an array: values one after another.
+		SEQUENCE
+	};
+
+	enum class kind
+	{
+		NONE,
+		SCALAR,
+		// A string or a container.
+		NESTED
+	};
+
+	bool fail(const char *what, const char *at)
+	{
+		err = string(what) + " at offset " + std::to_string(offset_ + (at ? at - base_ : 0));
+		return false;
+	}
+
+	// Handles the byte at q outside of records.
+	bool step(const char *&q)
+	{
+		switch (state_)
+		{
+		case state::START:
+			if (*q == '[')
+			{
+				state_ = state::FIRST;
+				++q;
+				return true;
+			}
+			if (layout_ == record_layout::ARRAY)
+				return fail("expected '['", q);
+			state_ = state::SEQUENCE;
+			return begin(q);
+		case state::FIRST:
+			if (*q == ']')
+			{
+				state_ = state::DONE;
+				++q;
+				return true;
+			}
+			state_ = state::NEXT;
+			return begin(q);
+		case state::ELEMENT:
+			state_ = state::NEXT;
+			return begin(q);
+		case state::NEXT:
+			if (*q == ',')
+				state_ = state::ELEMENT;
+			else if (*q == ']')
+				state_ = state::DONE;
+			else
+				return fail("expected ',' or ']'", q);
+			++q;
+			return true;
+		case state::SEQUENCE:
+			return begin(q);
+		default:
+			return fail("trailing characters", q);
+		}
+	}
+
+	bool begin(const char *q)
+	{
+		if (simd::is_op(*q) && *q != '{' && *q != '[')
+			return fail("invalid value", q);
+		kind_ = *q == '{' || *q == '[' || *q == '\"' ? kind::NESTED : kind::SCALAR;
+		start_ = offset_ + (q - base_);
+		depth_ = 0;
+		in_string_ = escape_ = false;
+		return true;
+	}
+
+	// End of the current record in [q, e), or e if it goes on.
+	const char * scan(const char *q, const char *e, bool &complete)
+	{
+		complete = false;
+		if (kind_ == kind::SCALAR)
+		{
+			for (; q != e && !simd::is_space(*q) && !simd::is_op(*q) && *q != '\"'; ++q);
+			complete = q != e;
+			return q;
+		}
+		while (q != e)
+		{
+			if (escape_)
+			{
+				escape_ = false;
+				++q;
+				continue;
+			}
+			if (in_string_)
+			{
+				q = simd::find_string_special(q, e);
+				if (q == e)
+					break;
+				if (*q == '\\')
+					escape_ = true;
+				else if (*q == '\"')
+				{
+					in_string_ = false;
+					if (depth_ == 0)
+					{
+						complete = true;
+						return q + 1;
+					}
+				}
+				++q;
+				continue;
+			}
+			q = simd::find_quote_or_bracket(q, e);
+			if (q == e)
+				break;
+			switch (*q++)
+			{
+			case '\"':
+				in_string_ = true;
+				break;
+			case '{':
+			case '[':
+				++depth_;
+				break;
+			default:
+				if (--depth_ == 0)
+				{
+					complete = true;
+					return q;
+				}
+				break;
+			}
+		}
+		return e;
+	}
+
+	bool emit()
+	{
+		parser p(rec_, opts_);
+		shared_ptr<json_value> v = p.parse_value();
+		if (!p.err.empty() || !v || v->type() == json::json_type::ERROR)
+		{
+			// A NUL byte reads as the end of the text and leaves no value.
+			size_t at = v || !p.err.empty() ? p.err_offset : p.p - p.s;
+			err = (p.err.empty() ? string("invalid value") : p.err) + " at offset " + std::to_string(start_ + at);
+			return false;
+		}
+		// A scalar ends at the first space or operator, so "1x" or "truex"
+		// gets here whole with the parser stopped short of its end.
+		if (p.p != p.e)
+		{
+			err = "trailing characters at offset " + std::to_string(start_ + (p.p - p.s));
+			return false;
+		}
+		kind_ = kind::NONE;
+		rec_.clear();
+		if (!f_(json(std::move(v))))
+		{
+			stopped = true;
+			return false;
+		}
+		return true;
+	}
+
+	const record_stream::callback &f_;
+	shape_registry shapes_;
+	parse_options opts_;
+	const record_layout layout_;
+	state state_;
+	kind kind_ = kind::NONE;
+	// Text of the current record and where it starts in the input.
+	string rec_;
+	size_t start_ = 0;
+	size_t depth_ = 0;
+	bool in_string_ = false;
+	bool escape_ = false;
+	// Input offset of base_, the start of the current block.
+	size_t offset_ = 0;
+	const char *base_ = nullptr;
+};
+
+}
+
+bool record_stream::parse_file(const string &path, const callback &f, string &err, const stream_options &opts)
+{
+	std::ifstream in(path, std::ios::binary);
+	if (!in)
+	{
+		err = "cannot open " + path;
+		return false;
+	}
+	return parse(in, f, err, opts);
+}
+
+bool record_stream::parse(std::istream &in, const callback &f, string &err, const stream_options &opts)
+{
+	const size_t block_size = std::max<size_t>(opts.block_size, 1);
+
+	string head(4, '\0');
+	in.read(&head[0], static_cast<std::streamsize>(head.size()));
+	head.resize(static_cast<size_t>(in.gcount()));
+	compression format = opts.format;
+	if (format == compression::AUTO)
+	{
+		if (head.size() >= 2 && head[0] == '\x1F' && head[1] == '\x8B')
+			format = compression::GZIP;
+		else if (head == "\x28\xB5\x2F\xFD")
+			format = compression::ZSTD;
+		else
+			format = compression::NONE;
+	}
+
+	std::unique_ptr<source> src;
+	switch (format)
+	{
+	case compression::GZIP:
+#ifdef QUARKSON_HAS_ZLIB
+		src.reset(new gzip_source(in, std::move(head), block_size));
+		break;
+#else
+		err = "gzip input needs a build with QUARKSON_HAS_ZLIB";
+		return false;
+#endif
+	case compression::ZSTD:
+#ifdef QUARKSON_HAS_ZSTD
+		src.reset(new zstd_source(in, std::move(head), block_size));
+		break;
+#else
+		err = "zstd input needs a build with QUARKSON_HAS_ZSTD";
+		return false;
+#endif
+	default:
+		src.reset(new raw_source(in, std::move(head), block_size));
+		break;
+	}
+
+	block_queue queue(std::max<size_t>(opts.queue_blocks, 1));
+	std::thread reader([&]
+	{
+		string read_err;
+		for (;;)
+		{
+			string block = queue.take();
+			if (!src->next(block, read_err) || block.empty() || !queue.push(std::move(block)))
+				break;
+		}
+		queue.close(read_err);
+	});
+
+	record_splitter splitter(f, opts.parse, opts.layout);
+	bool ok = true;
+	try
+	{
+		string block;
+		while (ok && queue.pop(block))
+			ok = splitter.feed(block.data(), block.data() + block.size());
+	}
+	catch (...)
+	{
+		queue.cancel();
+		reader.join();
+		throw;
+	}
+	queue.cancel();
+	reader.join();
+
+	if (splitter.stopped)
+		return true;
+	if (!ok)
+	{
+		err = splitter.err;
+		return false;
+	}
+	err = queue.error();
+	if (!err.empty())
+		return false;
+	if (!splitter.finish() && !splitter.stopped)
+	{
+		err = splitter.err;
+		return false;
+	}
+	return true;
+}
+
+}
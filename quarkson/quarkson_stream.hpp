@@ -0,0 +1,66 @@
+#pragma once
+
+#include "json.hpp"
+#include "quarkson_parser.hpp"
+
+#include <functional>
+#include <iosfwd>
+
+namespace quarkson {
+
+// Decompression is opt-in, and the project files leave it out: build with
+// QUARKSON_HAS_ZLIB and link zlib for gzip, with QUARKSON_HAS_ZSTD and link
+// libzstd for zstd. Otherwise such input fails with an error naming the
+// macro.
+enum class compression
+{
+	// Told apart by the magic bytes at the start of the input.
+	AUTO,
+	NONE,
+	GZIP,
+	ZSTD
+};
+
+// How the records are laid out in the input.
+enum class record_layout
+{
+	// An array if the input starts with '[', otherwise a sequence. A
+	// sequence of arrays, such as NDJSON with one array per line, is taken
+	// for a malformed array; name the layout for those.
+	AUTO,
+	// The elements of a top-level array.
+	ARRAY,
+	// Values one after another, separated by whitespace if need be.
+	SEQUENCE
+};
+
+struct stream_options
+{
+	record_layout layout = record_layout::AUTO;
+	compression format = compression::AUTO;
+	// Bytes of decompressed text handed to the parser at a time.
+	size_t block_size = 1 << 16;
+	// Decompressed blocks that may wait for the parser.
+	size_t queue_blocks = 4;
+	parse_options parse;
+};
+
+// Parses a stream of records without holding more of it than a few blocks
+// and the current record. The records are the elements of a top-level
+// array, or a sequence of values separated by whitespace, such as one per
+// line (NDJSON); see record_layout. Compressed input is decompressed block
+// by block on a second thread while the calling thread parses.
+class record_stream
+{
+public:
+	// Gets each record as it completes; returning false stops the stream.
+	using callback = std::function<bool(json &&record)>;
+
+	// False with err set on unreadable, corrupt or invalid input; error
+	// offsets count decompressed bytes. Records before the error have been
+	// passed on. Stopping from the callback is not an error.
+	static bool parse_file(const string &path, const callback &f, string &err, const stream_options &opts = stream_options());
+	static bool parse(std::istream &in, const callback &f, string &err, const stream_options &opts = stream_options());
+};
+
+}
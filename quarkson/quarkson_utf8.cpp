@@ -0,0 +1,262 @@
+#include "quarkson_utf8.hpp"
+#include "quarkson_simd.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+#ifdef QUARKSON_SSE2
+#include <tmmintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#define QUARKSON_TARGET_SSSE3
+#else
+#define QUARKSON_TARGET_SSSE3 __attribute__((target("ssse3")))
+#endif
+#endif
+
+namespace quarkson {
+namespace utf8 {
+
+namespace {
+
+size_t validate_scalar(const unsigned char *p, size_t len)
+{
+	size_t i = 0;
+	while (i < len)
+	{
+		if (len - i >= 8)
+		{
+			uint64_t word;
+			memcpy(&word, p + i, 8);
+			if ((word & 0x8080808080808080ULL) == 0)
+			{
+				i += 8;
+				continue;
+			}
+		}
+
+		unsigned char c = p[i];
+		if (c < 0x80)
+		{
+			++i;
+			continue;
+		}
+
+		size_t n;
+		if (c >= 0xC2 && c <= 0xDF)
+			n = 2;
+		else if (c >= 0xE0 && c <= 0xEF)
+			n = 3;
+		else if (c >= 0xF0 && c <= 0xF4)
+			n = 4;
+		else
+			return i;
+
+		if (len - i < n)
+			return i;
+		for (size_t k = 1; k < n; ++k)
+			if ((p[i + k] & 0xC0) != 0x80)
+				return i;
+
+		unsigned char c1 = p[i + 1];
+		if ((c == 0xE0 && c1 < 0xA0) || (c == 0xED && c1 >= 0xA0) ||
+			(c == 0xF0 && c1 < 0x90) || (c == 0xF4 && c1 >= 0x90))
+			return i;
+
+		i += n;
+	}
+	return len;
+}
+
+#ifdef QUARKSON_SSE2
+
+// Lookup-table validation after Keiser and Lemire, "Validating UTF-8 In Less
+// Than One Instruction Per Byte". Each byte is checked against the previous
+// three through three 16-entry tables indexed by nibbles; any error class
+// present in all three lookups marks the pair as invalid.
+const uint8_t TOO_SHORT = 1 << 0;
+const uint8_t TOO_LONG = 1 << 1;
+const uint8_t OVERLONG_3 = 1 << 2;
+const uint8_t TOO_LARGE = 1 << 3;
+const uint8_t SURROGATE = 1 << 4;
+const uint8_t OVERLONG_2 = 1 << 5;
+const uint8_t TOO_LARGE_1000 = 1 << 6;
+const uint8_t OVERLONG_4 = 1 << 6;
+const uint8_t TWO_CONTS = 1 << 7;
+const uint8_t CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS;
+
+QUARKSON_TARGET_SSSE3
+inline __m128i table(uint8_t a0, uint8_t a1, uint8_t a2, uint8_t a3, uint8_t a4, uint8_t a5, uint8_t a6, uint8_t a7,
+	uint8_t a8, uint8_t a9, uint8_t a10, uint8_t a11, uint8_t a12, uint8_t a13, uint8_t a14, uint8_t a15)
+{
+	return _mm_setr_epi8(static_cast<char>(a0), static_cast<char>(a1), static_cast<char>(a2), static_cast<char>(a3),
+		static_cast<char>(a4), static_cast<char>(a5), static_cast<char>(a6), static_cast<char>(a7),
+		static_cast<char>(a8), static_cast<char>(a9), static_cast<char>(a10), static_cast<char>(a11),
+		static_cast<char>(a12), static_cast<char>(a13), static_cast<char>(a14), static_cast<char>(a15));
+}
+
+QUARKSON_TARGET_SSSE3
+inline __m128i high_nibbles(__m128i v)
+{
+	return _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0x0F));
+}
+
+QUARKSON_TARGET_SSSE3
+inline __m128i check_block(__m128i input, __m128i prev_input)
+{
+	const __m128i byte_1_high_table = table(
+		TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+		TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+		TOO_SHORT | OVERLONG_2,
+		TOO_SHORT,
+		TOO_SHORT | OVERLONG_3 | SURROGATE,
+		TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4);
+	const __m128i byte_1_low_table = table(
+		CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+		CARRY | OVERLONG_2,
+		CARRY,
+		CARRY,
+		CARRY | TOO_LARGE,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000);
+	const __m128i byte_2_high_table = table(
+		TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+		TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT);
+
+	__m128i prev1 = _mm_alignr_epi8(input, prev_input, 15);
+	__m128i special = _mm_and_si128(_mm_and_si128(
+		_mm_shuffle_epi8(byte_1_high_table, high_nibbles(prev1)),
+		_mm_shuffle_epi8(byte_1_low_table, _mm_and_si128(prev1, _mm_set1_epi8(0x0F)))),
+		_mm_shuffle_epi8(byte_2_high_table, high_nibbles(input)));
+
+	// Third and fourth bytes of a sequence must be continuations; the tables
+	// above flag those as TWO_CONTS, which these cancel out.
+	__m128i prev2 = _mm_alignr_epi8(input, prev_input, 14);
+	__m128i prev3 = _mm_alignr_epi8(input, prev_input, 13);
+	__m128i must23 = _mm_or_si128(_mm_subs_epu8(prev2, _mm_set1_epi8(static_cast<char>(0xE0 - 0x80))),
+		_mm_subs_epu8(prev3, _mm_set1_epi8(static_cast<char>(0xF0 - 0x80))));
+	__m128i must23_80 = _mm_and_si128(must23, _mm_set1_epi8(static_cast<char>(0x80)));
+	return _mm_xor_si128(must23_80, special);
+}
+
+// Non-zero if the block ends in the middle of a multi-byte sequence.
+QUARKSON_TARGET_SSSE3
+inline __m128i incomplete(__m128i input)
+{
+	const __m128i max_value = table(
+		0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+		0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xF0 - 1, 0xE0 - 1, 0xC0 - 1);
+	return _mm_subs_epu8(input, max_value);
+}
+
+QUARKSON_TARGET_SSSE3
+size_t validate_ssse3(const char *p, size_t len)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i prev_input = zero;
+	__m128i prev_incomplete = zero;
+	size_t i = 0;
+
+	auto locate = [&](size_t at)
+	{
+		// Everything before the block at 'at' was valid, so the broken
+		// sequence starts on the last lead byte among the three before it.
+		size_t from = at;
+		for (size_t k = at; k > 0 && at - k < 3; --k)
+			if ((static_cast<unsigned char>(p[k - 1]) & 0xC0) != 0x80)
+			{
+				from = k - 1;
+				break;
+			}
+		return from + validate_scalar(reinterpret_cast<const unsigned char *>(p) + from, len - from);
+	};
+
+	for (; i < len; i += 16)
+	{
+		__m128i input;
+		if (len - i >= 16)
+			input = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+		else
+		{
+			char tail[16] = {};
+			memcpy(tail, p + i, len - i);
+			input = _mm_loadu_si128(reinterpret_cast<const __m128i *>(tail));
+		}
+
+		// ASCII fast path: only a sequence left open by the previous block
+		// can make an all-ASCII block invalid.
+		__m128i error = prev_incomplete;
+		prev_incomplete = zero;
+		if (_mm_movemask_epi8(input) != 0)
+		{
+			error = check_block(input, prev_input);
+			prev_incomplete = incomplete(input);
+		}
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(error, zero)) != 0xFFFF)
+			return locate(i);
+		prev_input = input;
+	}
+
+	// A short tail is padded with zeros, which already flags a sequence cut
+	// off by the end; only a full last block can leave one open.
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(prev_incomplete, zero)) != 0xFFFF)
+		return locate(i - 16);
+	return len;
+}
+
+bool cpu_has_ssse3()
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] & (1 << 9)) != 0;
+#else
+	return __builtin_cpu_supports("ssse3");
+#endif
+}
+
+#endif
+
+size_t validate_portable(const char *p, size_t len)
+{
+	return validate_scalar(reinterpret_cast<const unsigned char *>(p), len);
+}
+
+using validate_fn = size_t (*)(const char *, size_t);
+
+validate_fn resolve()
+{
+#ifdef QUARKSON_SSE2
+	if (cpu_has_ssse3())
+		return validate_ssse3;
+#endif
+	return validate_portable;
+}
+
+}
+
+size_t validate(const char *p, size_t len)
+{
+	static const validate_fn impl = resolve();
+
+	// Runs inside string literals are usually short; below one vector the
+	// scalar loop wins.
+	if (len < 16)
+		return validate_scalar(reinterpret_cast<const unsigned char *>(p), len);
+	return impl(p, len);
+}
+
+}
+}
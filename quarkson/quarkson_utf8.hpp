@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstddef>
+
+namespace quarkson {
+namespace utf8 {
+
+// Returns the offset of the first byte of the first invalid UTF-8 sequence
+// in [p, p + len), or len if the whole range is valid. Overlong forms,
+// surrogates (U+D800..U+DFFF) and code points above U+10FFFF are invalid.
+// Uses an SSSE3 lookup-table validator when the CPU has it.
+size_t validate(const char *p, size_t len);
+
+}
+}
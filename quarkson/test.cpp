@@ -1,9 +1,19 @@
 #include <iostream>
 #include <iomanip>
 #include <cstdio>
+#include <cmath>
+#include <thread>
+#include <sstream>
 
 #include "json.hpp"
 #include "quarkson_parser.hpp"
+#include "quarkson_format.hpp"
+#include "quarkson_columnar.hpp"
+#include "quarkson_index.hpp"
+#include "quarkson_static.hpp"
+#include "quarkson_generator.hpp"
+#include "quarkson_cache.hpp"
+#include "quarkson_stream.hpp"
 
 using std::cout;
 using std::endl;
@@ -11,6 +21,25 @@ using std::endl;
 using quarkson::json;
 using quarkson::json_value;
 using quarkson::parser;
+using quarkson::parse_options;
+using quarkson::shape_registry;
+using quarkson::projection;
+using quarkson::compact_stats;
+using quarkson::formatter;
+using quarkson::generator;
+using quarkson::parse_cache;
+using quarkson::cache_stats;
+using quarkson::record_stream;
+using quarkson::stream_options;
+using quarkson::compression;
+using quarkson::record_layout;
+using quarkson::columnar;
+using quarkson::column_spec;
+using quarkson::column_table;
+using quarkson::column_type;
+using quarkson::offset_index;
+using quarkson::static_json;
+using namespace quarkson::literals;
 
 static int main_ret = 0;
 static int test_count = 0;
@@ -118,6 +147,34 @@ static void test_parse_string()
 	TEST_STRING("\xF0\x90\x80\x80", "\"\\uD800\\uDC00\"");
 
 	TEST_STRING("\xF4\x8F\xBF\xBF", "\"\\uDBFF\\uDFFF\"");
+
+	TEST_STRING("\xC3\xA9", "\"\\u00E9\"");
+	TEST_STRING("\xC3\xA9t\xC3\xA9 \xE4\xB8\xA5 \xF0\x9F\x98\x80", "\"\xC3\xA9t\xC3\xA9 \xE4\xB8\xA5 \xF0\x9F\x98\x80\"");
+	TEST_STRING("a long run of ASCII before \xE2\x82\xAC and after it", "\"a long run of ASCII before \xE2\x82\xAC and after it\"");
+}
+
+#define TEST_ERROR_OFFSET(msg, jstr) \
+	do \
+	{ \
+		string err; \
+		json j = parser::parse(jstr, err); \
+		EXPECT_EQ_VALUE_TYPE(json::json_type::ERROR, j.type()); \
+		EXPECT_EQ_STRING(msg, err); \
+	} while (0)
+
+static void test_parse_invalid_unicode()
+{
+	TEST_ERROR_OFFSET("invalid UTF-8 at offset 2", "\"a\x80\"");
+	TEST_ERROR_OFFSET("invalid UTF-8 at offset 1", "\"\xC0\xAF\"");
+	TEST_ERROR_OFFSET("invalid UTF-8 at offset 1", "\"\xED\xA0\x80\"");
+	TEST_ERROR_OFFSET("invalid UTF-8 at offset 1", "\"\xF4\x90\x80\x80\"");
+	TEST_ERROR_OFFSET("invalid UTF-8 at offset 3", "\"ab\xE4\xB8\"");
+	TEST_ERROR_OFFSET("invalid UTF-8 at offset 42", "[\"0123456789 0123456789 0123456789 \xC3\xA9 0123\xFF 0123456789\"]");
+
+	TEST_ERROR_OFFSET("unpaired low surrogate at offset 1", "\"\\uDC00\"");
+	TEST_ERROR_OFFSET("unpaired high surrogate at offset 1", "\"\\uD800\"");
+	TEST_ERROR_OFFSET("unpaired high surrogate at offset 1", "\"\\uD800\\u0041\"");
+	TEST_ERROR_OFFSET("unpaired high surrogate at offset 3", "[ \"\\uDBFF\\uD800\"]");
 }
 
 static void test_parse_array()
@@ -257,8 +314,984 @@ static void test_parse_object()
 	}
 }
 
+static void test_object_key()
+{
+	static constexpr json::key latitude("Latitude");
+	static_assert(latitude.hash() == json::key::hash_bytes("Latitude"), "key hash is computed at compile time");
+
+	json j = parser::parse("{ \"precision\": \"zip\", \"Latitude\": 37.7668, \"Longitude\": -122.3959, \"Address\": \"\", \"City\": \"SAN FRANCISCO\", \"State\": \"CA\", \"Zip\": 94107, \"Country\": \"US\" }");
+	EXPECT_EQ_DOUBLE(37.7668, j.find(latitude)->get_number());
+	EXPECT_EQ_STRING("CA", j.find(json::key("State"))->get_string());
+	EXPECT_EQ_STRING("", j.find(json::key("Address"))->get_string());
+	EXPECT_EQ_BASE(j.find(json::key("Lat")) == nullptr, "null", "member");
+	EXPECT_EQ_BASE(j.find(json::key("")) == nullptr, "null", "member");
+
+	const json::object &obj = j.get_object();
+	EXPECT_EQ_BASE(obj.find(latitude) == obj.find(string("Latitude")), "same member", "different member");
+	EXPECT_EQ_BASE(obj.find(json::key("Zip")) == obj.find("Zip"), "same member", "different member");
+}
+
+static bool same_value(const shared_ptr<json_value> &a, const shared_ptr<json_value> &b)
+{
+	if (a->type() != b->type())
+		return false;
+
+	switch (a->type())
+	{
+	case json::json_type::OBJECT:
+	{
+		const json::object &oa = a->get_object(), &ob = b->get_object();
+		if (oa.size() != ob.size())
+			return false;
+		for (const auto &kv : oa)
+		{
+			auto it = ob.find(kv.first);
+			if (it == ob.end() || !same_value(kv.second, it->second))
+				return false;
+		}
+		return true;
+	}
+	case json::json_type::ARRAY:
+	{
+		const json::array &aa = a->get_array(), &ab = b->get_array();
+		if (aa.size() != ab.size())
+			return false;
+		for (size_t i = 0; i < aa.size(); ++i)
+			if (!same_value(aa[i], ab[i]))
+				return false;
+		return true;
+	}
+	case json::json_type::NUMBER:
+		return a->get_number() == b->get_number();
+	case json::json_type::STRING:
+		return a->get_string() == b->get_string();
+	case json::json_type::BOOLEAN:
+		return a->get_bool() == b->get_bool();
+	default:
+		return true;
+	}
+}
+
+static void test_parse_iterative()
+{
+	const char *docs[] = {
+		"[1, true, false, null, \"hello\"]",
+		"[1.23, [ true, false ], null]",
+		"[1, 2, \"x\", 3, [4, 5], 6]",
+		"{ \"a\": [ { \"b\": [] }, {} ], \"c\": { \"d\": { \"e\": [1, [2, [3]]] } } }",
+		"{ \"Image\": { \"Width\": 800, \"Height\": 600, \"Title\": \"View from 15th Floor\", \"Thumbnail\": { \"Url\": \"http:\\/\\/www.example.com\\/image\\/481989943\", \"Height\": 125, \"Width\": 100 }, \"Animated\" : false, \"IDs\": [116, 943, 234, 38793] } }",
+	};
+	for (const char *doc : docs)
+	{
+		string str = doc;
+		shared_ptr<json_value> iterative = parser(str).parse_value();
+		shared_ptr<json_value> recursive = parser(str).parse_value_recursive();
+		EXPECT_EQ_BASE(same_value(iterative, recursive), "same DOM", doc);
+	}
+
+	{
+		parse_options opts;
+		opts.max_depth = 10000;
+		string err;
+		json j = parser::parse(string(10000, '[') + string(10000, ']'), err, opts);
+		EXPECT_EQ_VALUE_TYPE(json::json_type::ARRAY, j.type());
+		EXPECT_EQ_STRING("", err);
+	}
+
+	{
+		string err;
+		json j = parser::parse(string(1025, '[') + string(1025, ']'), err);
+		EXPECT_EQ_VALUE_TYPE(json::json_type::ERROR, j.type());
+		EXPECT_EQ_STRING("nesting too deep at offset 1024", err);
+	}
+
+	{
+		parse_options opts;
+		opts.max_size = 4;
+		string err;
+		json j = parser::parse("[1, 2]", err, opts);
+		EXPECT_EQ_VALUE_TYPE(json::json_type::ERROR, j.type());
+		EXPECT_EQ_STRING("document too large at offset 0", err);
+	}
+
+	TEST_ERROR_OFFSET("expected ',' or ']' at offset 3", "[1 2]");
+	TEST_ERROR_OFFSET("expected ',' or '}' at offset 9", "{\"a\": [1]]");
+	TEST_ERROR_OFFSET("expected object key at offset 2", "{ 1: 2 }");
+	TEST_ERROR_OFFSET("unexpected end of input at offset 4", "[[1,");
+
+	// Frames a failed parse left filled start out empty when reused.
+	for (bool shapes : { false, true })
+	{
+		string str = "{ \"a\": 1, \"b\": x } { \"c\": 2 } [1, 2, x] [3] [\"s\", x] [\"t\"]";
+		parse_options opts;
+		opts.shapes = shapes;
+		parser ps(str, opts);
+		auto at = [&](const char *text)
+		{
+			ps.p = ps.s + str.find(text);
+			ps.err.clear();
+			return ps.parse_value();
+		};
+		EXPECT_EQ_VALUE_TYPE(json::json_type::ERROR, at("{ \"a\"")->type());
+		shared_ptr<json_value> v = at("{ \"c\"");
+		EXPECT_EQ_BASE(v->get_object().size() == 1, 1, v->get_object().size());
+		EXPECT_EQ_VALUE_TYPE(json::json_type::ERROR, at("[1, 2")->type());
+		EXPECT_EQ_BASE(at("[3]")->get_numbers().size() == 1, 1, ps.p - ps.s);
+		EXPECT_EQ_VALUE_TYPE(json::json_type::ERROR, at("[\"s\"")->type());
+		EXPECT_EQ_BASE(at("[\"t\"]")->get_array().size() == 1, 1, ps.p - ps.s);
+	}
+}
+
+static void test_packed_array()
+{
+	{
+		json j = parser::parse("{ \"IDs\": [116, 943, 234, 38793] }");
+		json ids = j.find(json::key("IDs"));
+		EXPECT_EQ_VALUE_TYPE(json::json_type::ARRAY, ids.type());
+		EXPECT_EQ_BASE(ids.is_packed(), "packed", "boxed");
+		std::span<const double> nums = ids.get_numbers();
+		EXPECT_EQ_BASE(nums.size() == 4, 4, nums.size());
+		EXPECT_EQ_DOUBLE(116.0, nums[0]);
+		EXPECT_EQ_DOUBLE(38793.0, nums[3]);
+
+		const json::array &arr = ids.get_array();
+		EXPECT_EQ_BASE(arr.size() == 4, 4, arr.size());
+		EXPECT_EQ_DOUBLE(943.0, arr[1]->get_number());
+		EXPECT_EQ_DOUBLE(234.0, arr[2]->get_number());
+		EXPECT_EQ_BASE(&arr == &ids.get_array(), "same array", "different array");
+	}
+
+	{
+		json j = parser::parse("[[1.5, -2e3], [1, \"a\"], [], [[3]]]");
+		const json::array &arr = j.get_array();
+		EXPECT_EQ_BASE(!j.is_packed(), "boxed", "packed");
+		EXPECT_EQ_BASE(arr[0]->is_packed(), "packed", "boxed");
+		EXPECT_EQ_DOUBLE(-2000.0, arr[0]->get_numbers()[1]);
+		EXPECT_EQ_BASE(!arr[1]->is_packed() && arr[1]->get_numbers().empty(), "boxed", "packed");
+		EXPECT_EQ_DOUBLE(1.0, arr[1]->get_array()[0]->get_number());
+		EXPECT_EQ_STRING("a", arr[1]->get_array()[1]->get_string());
+		EXPECT_EQ_BASE(!arr[2]->is_packed(), "boxed", "packed");
+		EXPECT_EQ_BASE(!arr[3]->is_packed(), "boxed", "packed");
+		EXPECT_EQ_BASE(arr[3]->get_array()[0]->is_packed(), "packed", "boxed");
+	}
+
+	{
+		parse_options opts;
+		opts.pack_numbers = false;
+		string err;
+		json j = parser::parse("[116, 943, 234, 38793]", err, opts);
+		EXPECT_EQ_BASE(!j.is_packed(), "boxed", "packed");
+		EXPECT_EQ_DOUBLE(943.0, j.get_array()[1]->get_number());
+	}
+
+	TEST_ERROR_OFFSET("expected ',' or ']' at offset 6", "[1, 2 3]");
+}
+
+static void test_projection()
+{
+	string doc = "{ \"Image\": { \"Width\": 800, \"Height\": 600, \"Title\": \"View from 15th Floor\", \"Thumbnail\": { \"Url\": \"http:\\/\\/www.example.com\\/image\\/481989943\", \"Height\": 125, \"Width\": 100 }, \"Animated\" : false, \"IDs\": [116, 943, 234, 38793] } }";
+	json full = parser::parse(doc);
+
+	{
+		json j = parser::parse(doc, projection{ "Image.Width", "Image.Thumbnail.Url", "Image.IDs", "Image.Missing" });
+		const json::object &image = j.find(json::key("Image"))->get_object();
+		EXPECT_EQ_BASE(image.size() == 3, 3, image.size());
+		EXPECT_EQ_DOUBLE(800.0, image.find("Width")->second->get_number());
+		EXPECT_EQ_BASE(same_value(image.find("IDs")->second, full.find(json::key("Image"))->find(json::key("IDs"))), "same IDs", "other");
+		const json::object &thumb = image.find("Thumbnail")->second->get_object();
+		EXPECT_EQ_BASE(thumb.size() == 1, 1, thumb.size());
+		EXPECT_EQ_STRING("http://www.example.com/image/481989943", thumb.find("Url")->second->get_string());
+	}
+
+	{
+		// Whole subtrees, and a path through a member that is not an object.
+		json j = parser::parse(doc, projection{ "Image.Thumbnail", "Image.Title.Text" });
+		const json::object &image = j.find(json::key("Image"))->get_object();
+		EXPECT_EQ_BASE(image.size() == 1, 1, image.size());
+		EXPECT_EQ_BASE(same_value(image.find("Thumbnail")->second, full.find(json::key("Image"))->find(json::key("Thumbnail"))), "same Thumbnail", "other");
+	}
+
+	{
+		// Arrays are transparent.
+		json j = parser::parse("[ { \"a\": 1, \"b\": { \"c\": [2, { \"d\": 3 }], \"e\": 4 } }, { \"b\": 5, \"a\": 2 }, 7 ]", projection{ "b.c" });
+		const json::array &arr = j.get_array();
+		EXPECT_EQ_BASE(arr.size() == 3, 3, arr.size());
+		EXPECT_EQ_BASE(arr[0]->get_object().size() == 1, 1, arr[0]->get_object().size());
+		const json::array &c = arr[0]->find(json::key("b"))->find(json::key("c"))->get_array();
+		EXPECT_EQ_DOUBLE(2.0, c[0]->get_number());
+		EXPECT_EQ_DOUBLE(3.0, c[1]->find(json::key("d"))->get_number());
+		EXPECT_EQ_BASE(arr[1]->get_object().empty(), "{}", "members");
+		EXPECT_EQ_DOUBLE(7.0, arr[2]->get_number());
+	}
+
+	{
+		// Every member named Width, at any depth.
+		projection widths([](const vector<string_view> &path)
+		{
+			if (path.back() == "Width")
+				return projection::action::INCLUDE;
+			return path.back() == "Image" || path.back() == "Thumbnail" ? projection::action::DESCEND : projection::action::SKIP;
+		});
+		json j = parser::parse(doc, widths);
+		const json::object &image = j.find(json::key("Image"))->get_object();
+		EXPECT_EQ_BASE(image.size() == 2, 2, image.size());
+		EXPECT_EQ_DOUBLE(800.0, image.find("Width")->second->get_number());
+		EXPECT_EQ_DOUBLE(100.0, image.find("Thumbnail")->second->find(json::key("Width"))->get_number());
+	}
+
+	{
+		string err;
+		json j = parser::parse("{ \"a\": ], \"b\": 1 }", err, parse_options(), projection{ "b" });
+		EXPECT_EQ_VALUE_TYPE(json::json_type::ERROR, j.type());
+		EXPECT_EQ_STRING("invalid value at offset 7", err);
+	}
+
+	{
+		// Scalars in an array on the way to a selected member are not
+		// selected; those of a selected array are.
+		json j = parser::parse("{ \"a\": [1, 2, { \"b\": 3 }, [4, { \"b\": 5 }], \"x\"], \"c\": [6, 7] }", projection{ "a.b", "c" });
+		const json::array &a = j.find(json::key("a"))->get_array();
+		EXPECT_EQ_BASE(a.size() == 2, 2, a.size());
+		EXPECT_EQ_DOUBLE(3.0, a[0]->find(json::key("b"))->get_number());
+		EXPECT_EQ_BASE(a[1]->get_array().size() == 1, 1, a[1]->get_array().size());
+		EXPECT_EQ_DOUBLE(5.0, a[1]->get_array()[0]->find(json::key("b"))->get_number());
+		EXPECT_EQ_BASE(j.find(json::key("c"))->get_numbers().size() == 2, 2, j.find(json::key("c"))->get_numbers().size());
+	}
+
+	{
+		// Skipped members must close their brackets in order.
+		string err;
+		for (const char *bad : { "{ \"a\": [}, \"b\": 1 }", "{ \"a\": {]}, \"b\": 1 }", "{ \"a\": [[{]}], \"b\": 1 }" })
+		{
+			json j = parser::parse(bad, err, parse_options(), projection{ "b" });
+			EXPECT_EQ_STRING("invalid value at offset 7", err);
+		}
+		string deep = "{ \"a\": " + string(100, '[') + "{}" + string(100, ']') + ", \"b\": 1 }";
+		EXPECT_EQ_DOUBLE(1.0, parser::parse(deep, projection{ "b" }).find(json::key("b"))->get_number());
+		deep = "{ \"a\": " + string(100, '[') + string(99, ']') + "}, \"b\": 1 }";
+		EXPECT_EQ_VALUE_TYPE(json::json_type::ERROR, parser::parse(deep, err, parse_options(), projection{ "b" }).type());
+	}
+}
+
+static void test_compact()
+{
+	string doc = "[";
+	for (int i = 0; i < 100; ++i)
+		doc += "{ \"country\": \"US\", \"status\": \"a fairly long status string\", \"geo\": { \"lat\": 1.5, \"tags\": [1, \"x\", null] }, \"id\": " + std::to_string(i) + " },";
+	doc.back() = ']';
+
+	json original = parser::parse(doc);
+	json j = parser::parse(doc);
+	// A copy shares the nodes; compacting j must leave them as they were.
+	json copy = j;
+	const json_value *copy_geo = copy.get_array()[99]->find(json::key("geo")).get();
+	compact_stats stats = j.compact();
+	EXPECT_EQ_BASE(copy.get_array()[99]->find(json::key("geo")).get() == copy_geo, "untouched", "rewritten");
+	EXPECT_EQ_BASE(copy.get_array()[0]->find(json::key("geo")) != copy.get_array()[99]->find(json::key("geo")), "untouched", "rewritten");
+	EXPECT_EQ_BASE(same_value(json_value::array_instance(j.get_array()), json_value::array_instance(original.get_array())), "same DOM", "other");
+
+	const json::array &records = j.get_array();
+	const shared_ptr<json_value> &first = records[0];
+	const shared_ptr<json_value> &last = records[99];
+	EXPECT_EQ_BASE(first->find(json::key("country")) == last->find(json::key("country")), "shared string", "copy");
+	EXPECT_EQ_BASE(first->find(json::key("geo")) == last->find(json::key("geo")), "shared subtree", "copy");
+	EXPECT_EQ_BASE(first->find(json::key("id")) != last->find(json::key("id")), "distinct ids", "shared");
+	EXPECT_EQ_BASE(first != last, "distinct records", "shared");
+	// Per record after the first: country, status, geo, lat, tags and the
+	// three tags; plus id 1, which matches the first tag.
+	EXPECT_EQ_BASE(stats.nodes_shared == 99 * 8 + 1, 99 * 8 + 1, stats.nodes_shared);
+	EXPECT_EQ_BASE(stats.bytes_saved > 99 * 8 * sizeof(void *), "bytes saved", stats.bytes_saved);
+
+	compact_stats again = j.compact();
+	EXPECT_EQ_BASE(again.nodes_shared == 0 && again.bytes_saved == 0, "nothing left to share", again.nodes_shared);
+
+	parse_options opts;
+	opts.dedup = true;
+	parser p(doc, opts);
+	shared_ptr<json_value> dedup = p.parse_value();
+	EXPECT_EQ_BASE(same_value(dedup, json_value::array_instance(original.get_array())), "same DOM", "other");
+	EXPECT_EQ_BASE(dedup->get_array()[3]->find(json::key("geo")) == dedup->get_array()[42]->find(json::key("geo")), "shared subtree", "copy");
+	EXPECT_EQ_BASE(p.interned.stats().nodes_shared == stats.nodes_shared, stats.nodes_shared, p.interned.stats().nodes_shared);
+}
+
+#define EXPECT_DOUBLE_MEMBER(obj, name, n) EXPECT_EQ_DOUBLE(n, (obj)->find(json::key(name))->get_number())
+
+static void test_shapes()
+{
+	string doc = "[ { \"id\": 1, \"name\": \"a\", \"pos\": { \"x\": 1, \"y\": 2 } }, { \"id\": 2, \"name\": \"b\", \"pos\": { \"x\": 3, \"y\": 4 } },"
+		" { \"name\": \"c\", \"id\": 3 }, { \"id\": 4, \"id\": 5 }, {} ]";
+	parse_options opts;
+	opts.shapes = true;
+	string err;
+	json j = parser::parse(doc, err, opts);
+	const json::array &records = j.get_array();
+
+	EXPECT_EQ_BASE(records[0]->shape() != nullptr && records[0]->shape() == records[1]->shape(), "shared shape", "none");
+	EXPECT_EQ_BASE(records[0]->find(json::key("pos"))->shape() == records[1]->find(json::key("pos"))->shape(), "shared shape", "none");
+	EXPECT_EQ_BASE(records[2]->shape() != nullptr && records[2]->shape() != records[0]->shape(), "own shape", "same shape");
+	EXPECT_EQ_BASE(records[3]->shape() == nullptr, "plain object", "shaped");
+	EXPECT_EQ_BASE(records[3]->get_object().size() == 1 && records[3]->find(json::key("id"))->get_number() == 4, "first id wins", "other");
+	EXPECT_EQ_BASE(records[4]->shape() == nullptr && records[4]->get_object().empty(), "empty object", "other");
+
+	// One key against alternating shapes, so the inline cache keeps
+	// switching.
+	static const json::key id("id"), name("name"), missing("missing");
+	for (int round = 0; round < 2; ++round)
+		for (size_t i = 0; i < 3; ++i)
+		{
+			EXPECT_EQ_DOUBLE(static_cast<double>(i + 1), records[i]->find(id)->get_number());
+			EXPECT_EQ_STRING(string(1, static_cast<char>('a' + i)), records[i]->find(name)->get_string());
+			EXPECT_EQ_BASE(records[i]->find(missing) == nullptr, "null", "member");
+		}
+
+	const json::object &obj = records[1]->get_object();
+	EXPECT_EQ_BASE(obj.size() == 3, 3, obj.size());
+	EXPECT_EQ_BASE(obj.find("pos")->second == records[1]->find(json::key("pos")), "same member", "copy");
+
+	json plain = parser::parse(doc);
+	EXPECT_EQ_BASE(same_value(json_value::array_instance(records), json_value::array_instance(plain.get_array())), "same DOM", "other");
+
+	opts.dedup = true;
+	json shared = parser::parse(doc, err, opts);
+	EXPECT_EQ_BASE(same_value(json_value::array_instance(shared.get_array()), json_value::array_instance(plain.get_array())), "same DOM", "other");
+
+	// Documents parsed apart share shapes through a registry of the caller.
+	shape_registry registry(2, 16);
+	opts.dedup = false;
+	opts.shared_shapes = &registry;
+	json first = parser::parse("{ \"id\": 1, \"name\": \"a\" }", err, opts);
+	json second = parser::parse("{ \"id\": 2, \"name\": \"b\" }", err, opts);
+	EXPECT_EQ_BASE(first.shape() != nullptr && first.shape() == second.shape(), "shared shape", "none");
+
+	// Past two branches at a path, objects are built plain, even when that
+	// happens partway through one.
+	json map = parser::parse("[{ \"a\": 1 }, { \"b\": 2 }, { \"id\": 3, \"p\": 4 }, { \"id\": 5, \"q\": 6 }, { \"id\": 7, \"r\": 8, \"r\": 9 }]", err, opts);
+	const json::array &maps = map.get_array();
+	EXPECT_EQ_BASE(maps[0]->shape() != nullptr && maps[1]->shape() == nullptr && maps[2]->shape() != nullptr, "shaped plain shaped", "other");
+	EXPECT_DOUBLE_MEMBER(maps[1], "b", 2.0);
+	EXPECT_EQ_BASE(maps[3]->shape() == nullptr && maps[3]->get_object().size() == 2, "plain", "other");
+	EXPECT_DOUBLE_MEMBER(maps[3], "id", 5.0);
+	EXPECT_DOUBLE_MEMBER(maps[3], "q", 6.0);
+	EXPECT_EQ_BASE(maps[4]->shape() == nullptr && maps[4]->get_object().size() == 2, "plain", "other");
+	EXPECT_DOUBLE_MEMBER(maps[4], "r", 8.0);
+	EXPECT_EQ_BASE(registry.size() <= 17, 17, registry.size());
+}
+
+static void test_static()
+{
+	// A malformed literal, e.g. "[1, 2"_qjson, fails to compile.
+	static constexpr static_json image = R"({ "Image": { "Width": 800, "Height": 600, "Title": "View from 15th Floor", "Thumbnail": { "Url": "http:\/\/www.example.com\/image\/481989943", "Height": 125, "Width": 100 }, "Animated" : false, "IDs": [116, 943, 234, 38793] } })"_qjson;
+	static_assert(image.type() == json::json_type::OBJECT);
+	static_assert(image.find("Image").size() == 6);
+	static_assert(image.find("Image").find("Width").get_number() == 800);
+	static_assert(image.find("Image").find("Thumbnail").find("Url").get_string() == "http://www.example.com/image/481989943");
+	static_assert(!image.find("Image").find("Animated").get_boolean());
+	static_assert(image.find("Image").find("IDs")[3].get_number() == 38793);
+	static_assert(image.find("Image").key(2) == "Title");
+	static_assert(!image.find("Missing"));
+
+	static constexpr static_json values = R"([null, true, "\u00e9\ud83d\ude00\n", -0.5e-3, 1.7976931348623157e308, 5e-324, [], {}])"_qjson;
+	static_assert(values.size() == 8);
+	static_assert(values[0].type() == json::json_type::NUL);
+	static_assert(values[2].get_string() == "\xc3\xa9\xf0\x9f\x98\x80\n");
+	static_assert(values[3].get_number() == -0.0005);
+	static_assert(values[4].get_number() == 1.7976931348623157e308);
+	static_assert(values[5].get_number() == 5e-324);
+	static_assert(values[6].type() == json::json_type::ARRAY && values[6].size() == 0);
+	static_assert(values[7].type() == json::json_type::OBJECT && values[7].size() == 0);
+
+	// Each rounds differently from a chain of floating-point operations.
+	static constexpr static_json hard = R"([8.98846567431158e307, 123.456e-200, 1e23, 9007199254740993, 9007199254740993.000000000000000000001,
+		1.7976931348623158e308, 7.038531e-26, 2.2250738585072011e-308, 2.2250738585072012e-308, 2.4703282292062328e-324, 0.1e-3000000000000])"_qjson;
+	static_assert(hard[0].get_number() == 8.98846567431158e307);
+	static_assert(hard[1].get_number() == 1.2345599999999999e-198);
+	static_assert(hard[2].get_number() == 1e23);
+	static_assert(hard[3].get_number() == 9007199254740992.0);
+	static_assert(hard[4].get_number() == 9007199254740994.0);
+	static_assert(hard[5].get_number() == 1.7976931348623157e308);
+	static_assert(hard[6].get_number() == 7.038531e-26);
+	static_assert(hard[7].get_number() == 2.2250738585072011e-308);
+	static_assert(hard[8].get_number() == 2.2250738585072012e-308);
+	static_assert(hard[9].get_number() == 5e-324);
+	static_assert(hard[10].get_number() == 0);
+	// The parser turns down the rest, which strtod reports as out of range.
+	const char *texts[] = { "8.98846567431158e307", "123.456e-200", "1e23", "9007199254740993", "9007199254740993.000000000000000000001",
+		"1.7976931348623158e308", "7.038531e-26" };
+	for (size_t i = 0; i < sizeof(texts) / sizeof(texts[0]); ++i)
+		EXPECT_EQ_BASE(hard[i].get_number() == parser::parse(texts[i]).get_number(), texts[i], hard[i].get_number());
+
+	// Past the digits kept, a nonzero digit still breaks a tie.
+	string tie = "9007199254740993." + string(1000, '0') + "1";
+	quarkson::static_node node;
+	char chars[1];
+	quarkson::static_parser(tie, &node, chars).run();
+	EXPECT_EQ_BASE(node.number == 9007199254740994.0, "rounded up", node.number);
+
+	// Raw bytes must be UTF-8; e.g. "[\"\xC0\xAF\"]"_qjson fails to compile.
+	static constexpr static_json raw = "[\"\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80\"]"_qjson;
+	static_assert(raw[0].get_string() == "\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80");
+
+	json parsed = parser::parse(R"({ "Image": { "Width": 800, "Height": 600, "Title": "View from 15th Floor", "Thumbnail": { "Url": "http:\/\/www.example.com\/image\/481989943", "Height": 125, "Width": 100 }, "Animated" : false, "IDs": [116, 943, 234, 38793] } })");
+	json copied = image.to_json();
+	EXPECT_EQ_BASE(same_value(copied.find(json::key("Image")), parsed.find(json::key("Image"))), "same DOM", "other");
+}
+
+static void test_parse_cache()
+{
+	EXPECT_EQ_BASE(parse_cache::hash("") == 0xEF46DB3751D8E999ULL, "XXH64", "other hash");
+	EXPECT_EQ_BASE(parse_cache::hash("abc") == 0x44BC2CF5AD770999ULL, "XXH64", "other hash");
+	EXPECT_EQ_BASE(parse_cache::hash("Nobody inspects the spammish repetition") == 0xFBCEA83C8A378BF1ULL, "XXH64", "other hash");
+
+	string a = "{ \"flags\": [\"x\", \"y\"], \"v\": 1 }", b = "[1, 2, 3]";
+	parse_cache cache(1 << 20);
+	json first = cache.parse(a);
+	json again = cache.parse(string(a));
+	EXPECT_EQ_BASE(&first.get_object() == &again.get_object(), "shared DOM", "parsed again");
+	EXPECT_EQ_DOUBLE(1.0, again.find(json::key("v"))->get_number());
+	json other = cache.parse(b);
+	EXPECT_EQ_BASE(other.get_numbers().size() == 3, "packed", "boxed");
+
+	string err;
+	EXPECT_EQ_VALUE_TYPE(json::json_type::ERROR, cache.parse("[1 2]", err).type());
+	EXPECT_EQ_STRING("expected ',' or ']' at offset 3", err);
+	cache.parse("[1 2]", err);
+	EXPECT_EQ_VALUE_TYPE(json::json_type::ERROR, cache.parse("", err).type());
+	EXPECT_EQ_STRING("unexpected end of input at offset 0", err);
+	EXPECT_EQ_VALUE_TYPE(json::json_type::ERROR, cache.parse("  \n", err).type());
+	EXPECT_EQ_STRING("unexpected end of input at offset 3", err);
+	cache_stats st = cache.stats();
+	EXPECT_EQ_BASE(st.hits == 1 && st.misses == 6 && st.evictions == 0 && st.entries == 2, "1 hit 6 misses 2 entries", "other counts");
+	EXPECT_EQ_BASE(st.bytes > a.size() + b.size(), "text and DOM", "less");
+
+	// Room for about one entry: a comes back after b pushed it out.
+	parse_cache small(st.bytes - 1);
+	small.parse(a);
+	small.parse(b);
+	json reparsed = small.parse(a);
+	st = small.stats();
+	EXPECT_EQ_BASE(st.hits == 0 && st.misses == 3 && st.evictions == 2 && st.entries == 1, "0 hits 3 misses 2 evictions", "other counts");
+	EXPECT_EQ_BASE(same_value(json_value::object_instance(reparsed.get_object()), json_value::object_instance(first.get_object())), "same DOM", "other");
+
+	small.clear();
+	EXPECT_EQ_BASE(small.stats().entries == 0 && small.stats().bytes == 0, "empty", "entries left");
+	parse_cache none(0);
+	none.parse(a);
+	EXPECT_EQ_BASE(none.stats().entries == 0, "not cached", "cached");
+
+	vector<std::thread> pool;
+	for (int t = 0; t < 4; ++t)
+		pool.emplace_back([&] { for (int i = 0; i < 100; ++i) cache.parse(i % 2 ? a : b); });
+	for (auto &t : pool)
+		t.join();
+	st = cache.stats();
+	EXPECT_EQ_BASE(st.hits + st.misses == 407 && st.entries == 2, "407 lookups", "other counts");
+
+	// Compacting a hit repoints only that copy, so some threads compact the
+	// cached document while others read it.
+	string dup = "[{\"k\":[1,\"x\"]},{\"k\":[1,\"x\"]},{\"k\":[1,\"x\"]}]";
+	const string text = generator::generate(cache.parse(dup));
+	vector<int> wrong(4, 0);
+	pool.clear();
+	for (int t = 0; t < 4; ++t)
+		pool.emplace_back([&, t]
+		{
+			for (int i = 0; i < 100; ++i)
+			{
+				json doc = cache.parse(dup);
+				if (t % 2 == 0 && doc.compact().nodes_shared == 0)
+					++wrong[t];
+				if (generator::generate(doc) != text)
+					++wrong[t];
+			}
+		});
+	for (auto &t : pool)
+		t.join();
+	EXPECT_EQ_BASE(wrong[0] + wrong[1] + wrong[2] + wrong[3] == 0, 0, wrong[0] + wrong[1] + wrong[2] + wrong[3]);
+	json cached = cache.parse(dup);
+	EXPECT_EQ_BASE(cached.get_array()[0] != cached.get_array()[1], "uncompacted", "shared");
+
+	// Entries share their shapes, also when parsed on several threads.
+	parse_options shaped;
+	shaped.shapes = true;
+	parse_cache shapes(1 << 20, shaped);
+	vector<json> docs(4);
+	pool.clear();
+	for (int t = 0; t < 4; ++t)
+		pool.emplace_back([&, t] { docs[t] = shapes.parse("{ \"k\": " + std::to_string(t) + ", \"v\": [1] }"); });
+	for (auto &t : pool)
+		t.join();
+	for (int t = 0; t < 4; ++t)
+		EXPECT_EQ_BASE(docs[t].shape() != nullptr && docs[t].shape() == docs[0].shape(), "shared shape", t);
+}
+
 static void test_generator()
 {
+	EXPECT_EQ_STRING("null", generator::generate(parser::parse("null")));
+	EXPECT_EQ_STRING("[true,false,0,-1.5,1e+100,-2.5e-07]", generator::generate(parser::parse("[ true, false, 0, -1.5, 1E100, -25E-8 ]")));
+	EXPECT_EQ_STRING("[0.1,123456789012]", generator::generate(parser::parse("[0.1, 123456789012]")));
+	EXPECT_EQ_STRING("\"\\\" \\\\ / \\b\\f\\n\\r\\t \\u001F \xC3\xA9\"",
+		generator::generate(parser::parse("\"\\\" \\\\ \\/ \\b\\f\\n\\r\\t \\u001f \\u00e9\"")));
+	EXPECT_EQ_STRING("{\"a\":[{},[]]}", generator::generate(parser::parse("{ \"a\": [ { }, [ ] ] }")));
+
+	// Deep enough to overflow a recursive writer under ASan. The DOM still
+	// frees itself recursively, which caps how deep this can go.
+	{
+		const size_t DEPTH = 15000;
+		string deep;
+		for (size_t i = 0; i < DEPTH; ++i)
+			deep += i % 2 ? "{\"k\":" : "[";
+		deep += "1";
+		for (size_t i = DEPTH; i-- > 0; )
+			deep += i % 2 ? "}" : "]";
+		parse_options opts;
+		opts.max_depth = DEPTH;
+		string err;
+		json j = parser::parse(deep, err, opts);
+		EXPECT_EQ_BASE(deep == generator::generate(j), "round trip", err);
+		EXPECT_EQ_BASE(deep == generator::generate(j, 4), "round trip", err);
+	}
+
+	string doc = "{ \"Image\": { \"Width\": 800, \"Height\": 600, \"Title\": \"View from 15th Floor\", \"Thumbnail\": { \"Url\": \"http:\\/\\/www.example.com\\/image\\/481989943\", \"Height\": 125, \"Width\": 100 }, \"Animated\" : false, \"IDs\": [116, 943, 234, 38793] } }";
+	json j = parser::parse(doc);
+	json back = parser::parse(generator::generate(j));
+	EXPECT_EQ_BASE(same_value(json_value::object_instance(back.get_object()), json_value::object_instance(j.get_object())), "same DOM", "other");
+
+	// The records array is what gets split.
+	doc = "{ \"count\": 300, \"records\": [";
+	for (int i = 0; i < 300; ++i)
+		doc += "{ \"id\": " + std::to_string(i) + ", \"name\": \"n\\u00e9" + std::to_string(i) + "\", \"pos\": [" + std::to_string(i * 0.25) + ", 1e-7], \"tags\": [\"x\", null, true] },";
+	doc.back() = ']';
+	doc += " }";
+	parse_options opts;
+	string err;
+	for (int variant = 0; variant < 3; ++variant)
+	{
+		opts.shapes = variant >= 1;
+		opts.dedup = variant >= 2;
+		j = parser::parse(doc, err, opts);
+		string serial = generator::generate(j);
+		back = parser::parse(serial);
+		EXPECT_EQ_BASE(same_value(json_value::object_instance(back.get_object()), json_value::object_instance(parser::parse(doc).get_object())), "same DOM", "other");
+		for (unsigned threads : { 2u, 3u, 8u, 1000u })
+			EXPECT_EQ_STRING(serial, generator::generate(j, threads));
+	}
+
+	// A shared node is written in full where it is not the split one.
+	opts.dedup = true;
+	j = parser::parse("[ [1, 2, 3, 4, 5, 6, 7, 8, 9, 10], [1, 2, 3, 4, 5, 6, 7, 8, 9, 10], 7 ]", err, opts);
+	EXPECT_EQ_BASE(j.get_array()[0] == j.get_array()[1], "shared", "copies");
+	EXPECT_EQ_STRING("[[1,2,3,4,5,6,7,8,9,10],[1,2,3,4,5,6,7,8,9,10],7]", generator::generate(j, 4));
+	EXPECT_EQ_STRING("[]", generator::generate(parser::parse("[]"), 4));
+	EXPECT_EQ_STRING("{\"a\":1}", generator::generate(parser::parse("{\"a\":1}"), 4));
+}
+
+static void test_columnar()
+{
+	string doc = "[ { \"precision\": \"zip\", \"Latitude\": 37.7668, \"Longitude\": -122.3959, \"City\": \"SAN FRANCISCO\", \"Zip\": 94107, \"Meta\": { \"Id\": 1 } },"
+		" { \"Latitude\": 37.371991, \"Longitude\": -122.02602, \"City\": \"SUNNYVALE\", \"Zip\": \"94085\", \"Meta\": { \"Skip\": [1, { \"x\": \"]\" }], \"Id\": 2 } },"
+		" null,"
+		" { \"Latitude\": 1e2, \"City\": null, \"Zip\": 10001.0, \"Extra\": { \"a\": [\"}\", 2] }, \"Meta\": 5 } ]";
+	vector<column_spec> specs = {
+		{ "Latitude", column_type::DOUBLE },
+		{ "Longitude", column_type::DOUBLE },
+		{ "City", column_type::STRING },
+		{ "Zip", column_type::INT64 },
+		{ "Meta.Id", column_type::INT64 },
+	};
+
+	auto check = [](const column_table &t)
+	{
+		EXPECT_EQ_BASE(t.rows == 4, 4, t.rows);
+
+		const quarkson::column &lat = *t.find("Latitude");
+		EXPECT_EQ_BASE(columnar::count(lat) == 3, 3, columnar::count(lat));
+		EXPECT_EQ_DOUBLE(37.7668 + (37.371991 + 100), columnar::sum(lat));
+		EXPECT_EQ_DOUBLE(37.371991, columnar::min(lat));
+		EXPECT_EQ_DOUBLE(100.0, columnar::max(lat));
+		EXPECT_EQ_BASE(!lat.is_valid(2), "null", "value");
+
+		const quarkson::column &lon = *t.find("Longitude");
+		EXPECT_EQ_DOUBLE(-122.3959, columnar::min(lon));
+		EXPECT_EQ_DOUBLE(-122.02602, columnar::max(lon));
+
+		const quarkson::column &city = *t.find("City");
+		EXPECT_EQ_BASE(city.null_count == 2, 2, city.null_count);
+		EXPECT_EQ_BASE(columnar::count(city) == 2, 2, columnar::count(city));
+		EXPECT_EQ_STRING("SAN FRANCISCO", string(city.get_string(0)));
+		EXPECT_EQ_STRING("SUNNYVALE", string(city.get_string(1)));
+		EXPECT_EQ_STRING("", string(city.get_string(3)));
+
+		const quarkson::column &zip = *t.find("Zip");
+		EXPECT_EQ_BASE(zip.ints[0] == 94107 && !zip.is_valid(1) && zip.ints[3] == 10001, "94107 null null 10001", "other");
+		EXPECT_EQ_BASE(columnar::sum_int64(zip) == 94107 + 10001, 94107 + 10001, columnar::sum_int64(zip));
+		EXPECT_EQ_BASE(columnar::min_int64(zip) == 10001, 10001, columnar::min_int64(zip));
+
+		const quarkson::column &id = *t.find("Meta.Id");
+		EXPECT_EQ_BASE(id.null_count == 2 && id.ints[0] == 1 && id.ints[1] == 2, "1 2 null null", "other");
+	};
+
+	check(columnar::extract(doc, specs));
+	check(columnar::extract(parser::parse(doc), specs));
+
+	{
+		string err;
+		column_table t = columnar::extract("[{ \"Latitude\": 1 }, { \"Latitude\": 2,]", specs, err);
+		EXPECT_EQ_STRING("expected object key at offset 36", err);
+		EXPECT_EQ_BASE(t.rows == 1, 1, t.rows);
+	}
+
+	{
+		// The row that failed leaves nothing behind.
+		string err;
+		column_table t = columnar::extract("[{ \"Latitude\": 1, \"City\": \"a\" }, { \"Latitude\": 2, \"City\": \"b\", \"Zip\": \"unterminated", specs, err);
+		EXPECT_EQ_BASE(!err.empty(), "error", "none");
+		EXPECT_EQ_BASE(t.rows == 1, 1, t.rows);
+		for (const quarkson::column &c : t.columns)
+		{
+			EXPECT_EQ_BASE(c.doubles.size() <= 1 && c.ints.size() <= 1 && c.validity.size() == 1, "one row", c.path);
+			EXPECT_EQ_BASE(c.null_count <= 1, "at most one null", c.null_count);
+		}
+		const quarkson::column &lat = *t.find("Latitude"), &city = *t.find("City");
+		EXPECT_EQ_BASE(columnar::count(lat) == 1 && columnar::sum(lat) == 1.0, "1", columnar::sum(lat));
+		EXPECT_EQ_BASE(columnar::count(city) == 1 && city.blob == "a", "a", city.blob);
+	}
+
+	{
+		// Several columns on one path all get the value, from text as from
+		// the DOM.
+		string dup = "[{ \"v\": 3, \"s\": \"a\\u0062\", \"n\": { \"x\": 2.5 } }, { \"v\": \"t\", \"s\": 7, \"n\": { \"x\": -4 } }, { \"v\": 1.5e1 }]";
+		vector<column_spec> same = {
+			{ "v", column_type::DOUBLE }, { "v", column_type::INT64 }, { "v", column_type::STRING },
+			{ "s", column_type::STRING }, { "s", column_type::STRING }, { "n.x", column_type::INT64 }, { "n.x", column_type::DOUBLE },
+		};
+		column_table text = columnar::extract(dup, same), dom = columnar::extract(parser::parse(dup), same);
+		EXPECT_EQ_BASE(text.rows == 3 && dom.rows == 3, 3, text.rows);
+		for (size_t i = 0; i < same.size(); ++i)
+		{
+			const quarkson::column &a = text.columns[i], &b = dom.columns[i];
+			EXPECT_EQ_BASE(a.validity == b.validity && a.null_count == b.null_count, "same nulls", same[i].path);
+			EXPECT_EQ_BASE(a.doubles == b.doubles && a.ints == b.ints, "same numbers", same[i].path);
+			EXPECT_EQ_BASE(a.blob == b.blob && a.offsets == b.offsets, "same strings", same[i].path);
+		}
+		EXPECT_EQ_BASE(text.columns[0].doubles[0] == 3 && text.columns[1].ints[2] == 15 && text.columns[2].get_string(1) == "t", "3 15 t", "other");
+		EXPECT_EQ_BASE(text.columns[3].get_string(0) == "ab" && text.columns[4].get_string(0) == "ab", "ab ab", "other");
+		EXPECT_EQ_BASE(!text.columns[5].is_valid(0) && text.columns[5].ints[1] == -4 && text.columns[6].doubles[0] == 2.5, "null -4 2.5", "other");
+	}
+
+	{
+		// Numbers follow the JSON grammar, not strtoll's or strtod's.
+		string err;
+		for (const char *bad : { "[{ \"Zip\": 0123 }]", "[{ \"Zip\": -01 }]", "[{ \"Latitude\": 1. }]", "[{ \"Latitude\": 0x10 }]" })
+		{
+			err.clear();
+			columnar::extract(bad, specs, err);
+			EXPECT_EQ_BASE(!err.empty(), "error", bad);
+			EXPECT_EQ_VALUE_TYPE(json::json_type::ERROR, parser::parse(bad).type());
+		}
+		err.clear();
+		columnar::extract("[{ \"Zip\": 0123 }]", specs, err);
+		EXPECT_EQ_STRING("expected ',' or '}' at offset 11", err);
+	}
+
+	{
+		column_table t = columnar::extract("[]", specs);
+		EXPECT_EQ_BASE(t.rows == 0, 0, t.rows);
+		EXPECT_EQ_BASE(std::isnan(columnar::min(t.columns[0])), "NaN", columnar::min(t.columns[0]));
+	}
+}
+
+static void write_file(const string &path, const string &text)
+{
+	FILE *f = fopen(path.c_str(), "wb");
+	fwrite(text.data(), 1, text.size(), f);
+	fclose(f);
+}
+
+static void test_offset_index()
+{
+	const string path = "quarkson_test_index.json";
+	write_file(path, "[ { \"id\": \"b\", \"v\": [1, \"]\"] },\n { \"v\": 2, \"id\": 42 }, \"x\" ,{ \"id\": \"a\\u0041\" }, { \"id\": \"b\" }, null ]\n");
+
+	string err;
+	EXPECT_EQ_BASE(offset_index::build(path, "id", err), "built", err);
+	offset_index index;
+	EXPECT_EQ_BASE(index.open(path, err), "opened", err);
+	EXPECT_EQ_BASE(index.size() == 6, 6, index.size());
+	EXPECT_EQ_STRING("id", index.key_field());
+	EXPECT_EQ_STRING("{ \"v\": 2, \"id\": 42 }", string(index.raw(1)));
+	EXPECT_EQ_STRING("\"x\"", string(index.raw(2)));
+	EXPECT_EQ_STRING("null", string(index.raw(5)));
+
+	json first = index.at(0);
+	EXPECT_EQ_STRING("]", first.find(json::key("v"))->get_array()[1]->get_string());
+	EXPECT_EQ_BASE(index.lookup("b") == 0, 0, index.lookup("b"));
+	EXPECT_EQ_BASE(index.lookup("42") == 1, 1, index.lookup("42"));
+	EXPECT_EQ_BASE(index.lookup("aA") == 3, 3, index.lookup("aA"));
+	EXPECT_EQ_BASE(index.lookup("c") == offset_index::npos, "npos", index.lookup("c"));
+	EXPECT_EQ_DOUBLE(2.0, index.at(index.lookup("42")).find(json::key("v"))->get_number());
+	EXPECT_EQ_BASE(index.raw(6).empty(), "empty", string(index.raw(6)));
+	EXPECT_EQ_VALUE_TYPE(json::json_type::ERROR, index.at(6, err).type());
+	EXPECT_EQ_STRING("no element 6 of 6", err);
+
+	// An element that ends past the source file.
+	FILE *f = fopen(offset_index::index_path(path).c_str(), "r+b");
+	uint64_t end = 1 << 20;
+	fseek(f, 64 + 8, SEEK_SET);
+	fwrite(&end, sizeof(end), 1, f);
+	fclose(f);
+	EXPECT_EQ_BASE(index.open(path, err), "opened", err);
+	EXPECT_EQ_BASE(index.raw(0).empty(), "empty", string(index.raw(0)));
+	EXPECT_EQ_VALUE_TYPE(json::json_type::ERROR, index.at(0, err).type());
+	EXPECT_EQ_STRING("element 0 lies outside the file", err);
+	EXPECT_EQ_VALUE_TYPE(json::json_type::ERROR, index.at(0).type());
+
+	// A count that wraps when multiplied by the span size.
+	f = fopen(offset_index::index_path(path).c_str(), "r+b");
+	uint64_t count = (1ULL << 60) + 6;
+	fseek(f, 24, SEEK_SET);
+	fwrite(&count, sizeof(count), 1, f);
+	fclose(f);
+	EXPECT_EQ_BASE(!index.open(path, err), "bad count", "opened");
+	EXPECT_EQ_STRING("truncated index", err);
+	EXPECT_EQ_BASE(index.size() == 0, 0, index.size());
+
+	// Positions only.
+	EXPECT_EQ_BASE(offset_index::build(path, err), "built", err);
+	EXPECT_EQ_BASE(index.open(path, err), "opened", err);
+	EXPECT_EQ_BASE(index.size() == 6 && index.lookup("b") == offset_index::npos, "positions only", "keys");
+
+	write_file(path, "[1, 2, 3]");
+	EXPECT_EQ_BASE(!index.open(path, err), "stale index", "opened");
+	EXPECT_EQ_STRING("index is out of date", err);
+
+	write_file(path, "[1, 2 3]");
+	EXPECT_EQ_BASE(!offset_index::build(path, err), "malformed", "built");
+	EXPECT_EQ_STRING("expected ',' or ']' at offset 6", err);
+	write_file(path, "[1, [2, {3]}]");
+	EXPECT_EQ_BASE(!offset_index::build(path, err), "mismatched", "built");
+	EXPECT_EQ_STRING("invalid value at offset 10", err);
+
+	// Names match once unescaped.
+	write_file(path, "[{ \"\\u0069d\": \"x\" }, { \"i\\u0064\": 7, \"id\": 8 }]");
+	EXPECT_EQ_BASE(offset_index::build(path, "id", err), "built", err);
+	EXPECT_EQ_BASE(index.open(path, err), "opened", err);
+	EXPECT_EQ_BASE(index.lookup("x") == 0 && index.lookup("7") == 1 && index.lookup("8") == offset_index::npos, "x 7", "other");
+
+	std::remove(path.c_str());
+	std::remove(offset_index::index_path(path).c_str());
+}
+
+// The records of text, generated and separated by '|'.
+static string stream_records(const string &text, bool &ok, string &err, const stream_options &opts, size_t stop = static_cast<size_t>(-1))
+{
+	std::istringstream in(text);
+	string out;
+	size_t n = 0;
+	ok = record_stream::parse(in, [&](json &&r)
+	{
+		out += (n == 0 ? "" : "|") + generator::generate(r);
+		return ++n < stop;
+	}, err, opts);
+	return out;
+}
+
+#ifdef QUARKSON_HAS_ZLIB
+#include <zlib.h>
+
+static string gzip(const string &text)
+{
+	z_stream z = {};
+	deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+	string out(deflateBound(&z, static_cast<uLong>(text.size())), '\0');
+	z.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(text.data()));
+	z.avail_in = static_cast<uInt>(text.size());
+	z.next_out = reinterpret_cast<Bytef *>(&out[0]);
+	z.avail_out = static_cast<uInt>(out.size());
+	deflate(&z, Z_FINISH);
+	out.resize(z.total_out);
+	deflateEnd(&z);
+	return out;
+}
+#endif
+
+#ifdef QUARKSON_HAS_ZSTD
+#include <zstd.h>
+
+static string zstd(const string &text)
+{
+	string out(ZSTD_compressBound(text.size()), '\0');
+	out.resize(ZSTD_compress(&out[0], out.size(), text.data(), text.size(), 3));
+	return out;
+}
+#endif
+
+static void test_record_stream()
+{
+	string array = "[ {\"a\": \"x]}\\\"y\", \"b\": [1, {}]}, [1,[2]] , \"s\\\"]\",12, -3.5e2,true ,null ]\n";
+	string records = "{\"a\":\"x]}\\\"y\",\"b\":[1,{}]}|[1,[2]]|\"s\\\"]\"|12|-350|true|null";
+	bool ok;
+	string err;
+	stream_options opts;
+	// Shaped, so that members come out in input order.
+	opts.parse.shapes = true;
+	for (size_t block : { 1, 2, 3, 7, 64 << 10 })
+	{
+		opts.block_size = block;
+		EXPECT_EQ_STRING(records, stream_records(array, ok, err, opts));
+		EXPECT_EQ_BASE(ok, "parsed", err);
+	}
+	opts.block_size = 4;
+	EXPECT_EQ_STRING("{\"a\":1}|{\"a\":[2]}|3|\"x\"|[]", stream_records("{\"a\":1}\n{\"a\":[2]}\n3\n\"x\"[]", ok, err, opts));
+	EXPECT_EQ_BASE(ok, "parsed", err);
+	EXPECT_EQ_STRING("", stream_records(" [ ] ", ok, err, opts));
+	EXPECT_EQ_BASE(ok, "parsed", err);
+	EXPECT_EQ_STRING("", stream_records("", ok, err, opts));
+	EXPECT_EQ_BASE(ok, "parsed", err);
+	EXPECT_EQ_STRING("[1,[2]]|\"s\\\"]\"", stream_records("[[1,[2]], \"s\\\"]\", 3, 4 5]", ok, err, opts, 2));
+	EXPECT_EQ_BASE(ok, "stopped", err);
+
+	auto error = [&](const string &text)
+	{
+		stream_records(text, ok, err, opts);
+		return ok ? string("parsed") : err;
+	};
+	EXPECT_EQ_STRING("unexpected end of input at offset 5", error("[1, 2"));
+	EXPECT_EQ_STRING("unexpected end of input at offset 7", error("[1, [2]"));
+	EXPECT_EQ_STRING("expected ',' or ']' at offset 3", error("[1 2]"));
+	EXPECT_EQ_STRING("trailing characters at offset 4", error("[1] x"));
+	EXPECT_EQ_STRING("invalid value at offset 4", error("[1, ]"));
+	EXPECT_EQ_STRING("invalid value at offset 4", error("[1, tru]"));
+	EXPECT_EQ_STRING("expected object key at offset 6", error("[1, { 1: 2 }]"));
+	EXPECT_EQ_STRING("trailing characters at offset 1", error("1x\n2"));
+	EXPECT_EQ_STRING("trailing characters at offset 4", error("truex"));
+	EXPECT_EQ_STRING("trailing characters at offset 2", error("[1x]"));
+	EXPECT_EQ_STRING("trailing characters at offset 2", error("12abc 5"));
+
+	// Records share their shapes.
+	{
+		std::istringstream in("{\"a\": 1, \"b\": 2}\n{\"a\": 3, \"b\": 4}");
+		vector<json> got;
+		ok = record_stream::parse(in, [&](json &&r) { got.push_back(std::move(r)); return true; }, err, opts);
+		EXPECT_EQ_BASE(ok && got.size() == 2 && got[0].shape() != nullptr && got[0].shape() == got[1].shape(), "shared shape", err);
+	}
+
+	// NDJSON of arrays reads as a malformed array unless the layout is named.
+	EXPECT_EQ_STRING("trailing characters at offset 6", error("[1,2]\n[3,4]"));
+	opts.layout = record_layout::SEQUENCE;
+	EXPECT_EQ_STRING("[1,2]|[3,4]", stream_records("[1,2]\n[3,4]", ok, err, opts));
+	EXPECT_EQ_BASE(ok, "parsed", err);
+	opts.layout = record_layout::ARRAY;
+	EXPECT_EQ_STRING("[1,2]|[3,4]", stream_records("[[1,2],\n[3,4]]", ok, err, opts));
+	EXPECT_EQ_BASE(ok, "parsed", err);
+	EXPECT_EQ_STRING("expected '[' at offset 1", error(" {\"a\":1}"));
+	EXPECT_EQ_STRING("unexpected end of input at offset 0", error(""));
+	opts.layout = record_layout::AUTO;
+
+	// A NUL byte is no value, whichever layout it turns up in.
+	EXPECT_EQ_STRING("invalid value at offset 0", error(string("\0", 1)));
+	EXPECT_EQ_STRING("invalid value at offset 1", error(string("[\0]", 3)));
+	EXPECT_EQ_STRING("invalid value at offset 2", error(string("1 \0", 3)));
+	opts.layout = record_layout::SEQUENCE;
+	EXPECT_EQ_STRING("invalid value at offset 4", error(string("[1]\n\0", 5)));
+	opts.layout = record_layout::AUTO;
+
+	const string path = "quarkson_test_stream.json.gz";
+#ifdef QUARKSON_HAS_ZLIB
+	// Two members, as from cat a.gz b.gz.
+	string half = array.substr(0, 30);
+	write_file(path, gzip(half) + gzip(array.substr(30)));
+	for (size_t block : { 1, 5, 64 << 10 })
+	{
+		opts.block_size = block;
+		err.clear();
+		string out;
+		ok = record_stream::parse_file(path, [&](json &&r) { out += (out.empty() ? "" : "|") + generator::generate(r); return true; }, err, opts);
+		EXPECT_EQ_BASE(ok, "parsed", err);
+		EXPECT_EQ_STRING(records, out);
+	}
+	string packed = gzip(array);
+	EXPECT_EQ_STRING("truncated gzip data", error(packed.substr(0, packed.size() - 10)));
+	packed[12] ^= 0x55;
+	EXPECT_EQ_BASE(error(packed) != "parsed", "corrupt", "parsed");
+	opts.format = compression::NONE;
+	EXPECT_EQ_STRING("invalid value at offset 0", error(gzip("[1]")));
+#else
+	write_file(path, string("\x1F\x8B\x08\x00", 4));
+	ok = record_stream::parse_file(path, [](json &&) { return true; }, err);
+	EXPECT_EQ_STRING("gzip input needs a build with QUARKSON_HAS_ZLIB", err);
+#endif
+	opts.format = compression::AUTO;
+#ifdef QUARKSON_HAS_ZSTD
+	// Two frames, as from cat a.zst b.zst.
+	write_file(path, zstd(array.substr(0, 30)) + zstd(array.substr(30)));
+	for (size_t block : { 1, 5, 64 << 10 })
+	{
+		opts.block_size = block;
+		err.clear();
+		string out;
+		ok = record_stream::parse_file(path, [&](json &&r) { out += (out.empty() ? "" : "|") + generator::generate(r); return true; }, err, opts);
+		EXPECT_EQ_BASE(ok, "parsed", err);
+		EXPECT_EQ_STRING(records, out);
+	}
+	string frame = zstd(array);
+	EXPECT_EQ_STRING("truncated zstd data", error(frame.substr(0, frame.size() - 10)));
+	frame[frame.size() / 2] ^= 0x55;
+	EXPECT_EQ_BASE(error(frame) != "parsed", "corrupt", "parsed");
+#else
+	write_file(path, "\x28\xB5\x2F\xFD");
+	ok = record_stream::parse_file(path, [](json &&) { return true; }, err);
+	EXPECT_EQ_STRING("zstd input needs a build with QUARKSON_HAS_ZSTD", err);
+#endif
+	std::remove(path.c_str());
+	EXPECT_EQ_BASE(!record_stream::parse_file(path, [](json &&) { return true; }, err), "missing", "opened");
+	EXPECT_EQ_STRING("cannot open " + path, err);
+}
+
+static void test_minify()
+{
+	EXPECT_EQ_STRING("null", formatter::minify(" null "));
+	EXPECT_EQ_STRING("[]", formatter::minify("[ \n ]"));
+	EXPECT_EQ_STRING("{}", formatter::minify("{\t}"));
+	EXPECT_EQ_STRING("[1,true,false,null,\"hello\"]", formatter::minify("[1, true, false, null, \"hello\"]"));
+	EXPECT_EQ_STRING("{\"a\":[1.5e-3,-0],\"b c\":\" x \\\" y \"}", formatter::minify(" { \"a\" : [ 1.5e-3 , -0 ] ,\r\n \"b c\" : \" x \\\" y \" } "));
+	EXPECT_EQ_STRING("\"\\u4E25\"", formatter::minify("\"\\u4E25\""));
+
+	EXPECT_EQ_STRING("", formatter::minify(""));
+	EXPECT_EQ_STRING("", formatter::minify("[1,]"));
+	EXPECT_EQ_STRING("", formatter::minify("{\"a\" 1}"));
+	EXPECT_EQ_STRING("", formatter::minify("[1] 2"));
+	EXPECT_EQ_STRING("", formatter::minify("\"abc"));
+	EXPECT_EQ_STRING("", formatter::minify("\"\\x\""));
+	EXPECT_EQ_STRING("", formatter::minify("[01]"));
+	EXPECT_EQ_STRING("", formatter::minify("[1.]"));
+	EXPECT_EQ_STRING("", formatter::minify("[nul]"));
+	EXPECT_EQ_STRING("", formatter::minify("[1}"));
+
+	// Strings must be UTF-8, as for the parser, also across 64-byte blocks.
+	EXPECT_EQ_STRING("[\"\xC3\xA9\",\"\xF0\x9F\x98\x80\"]", formatter::minify("[ \"\xC3\xA9\", \"\xF0\x9F\x98\x80\" ]"));
+	EXPECT_EQ_STRING("", formatter::minify("[\"\xC0\xAF\"]"));
+	EXPECT_EQ_STRING("", formatter::minify("{\"\xED\xA0\x80\": 1}"));
+	EXPECT_EQ_STRING("", formatter::minify("[\"\xC3\xA9\", \"\xC3\"]"));
+	string pad(60, ' ');
+	string across = "[" + pad + "\"ab\xE2\x82\xAC\"]";
+	EXPECT_EQ_STRING("[\"ab\xE2\x82\xAC\"]", formatter::minify(across));
+	across[pad.size() + 5] = 'x';
+	EXPECT_EQ_STRING("", formatter::minify(across));
+	string out;
+	EXPECT_EQ_BASE(!formatter::minify("[\"\xC0\xAF\"]", out) && parser::parse("[\"\xC0\xAF\"]").type() == json::json_type::ERROR, "both reject", "accepted");
+}
+
+static void test_prettify()
+{
+	EXPECT_EQ_STRING("[]", formatter::prettify("[ ]"));
+	EXPECT_EQ_STRING("{\n  \"a\": [\n    1,\n    {}\n  ],\n  \"b\": \"x y\"\n}", formatter::prettify("{\"a\":[1,{ }],\"b\":\"x y\"}", 2));
+	EXPECT_EQ_STRING("", formatter::prettify("{\"a\":}"));
+	EXPECT_EQ_STRING("", formatter::prettify("[\"\xC0\xAF\"]"));
+	EXPECT_EQ_STRING("", formatter::prettify("{\"\xFF\": 1}"));
+	EXPECT_EQ_STRING("[\n  \"\xC3\xA9\"\n]", formatter::prettify("[\"\xC3\xA9\"]", 2));
+
+	string doc = "{ \"Image\": { \"Width\": 800, \"Height\": 600, \"Title\": \"View from 15th Floor\", \"Thumbnail\": { \"Url\": \"http:\\/\\/www.example.com\\/image\\/481989943\", \"Height\": 125, \"Width\": 100 }, \"Animated\" : false, \"IDs\": [116, 943, 234, 38793] } }";
+	EXPECT_EQ_STRING(formatter::minify(doc), formatter::minify(formatter::prettify(doc)));
 }
 
 static void test_parse()
@@ -269,14 +1302,299 @@ static void test_parse()
 	test_parse_false();
 	test_parse_number();
 	test_parse_string();
+	test_parse_invalid_unicode();
 	test_parse_array();
 	test_parse_object();
+	test_parse_iterative();
+	test_packed_array();
+	test_projection();
+	test_compact();
+	test_shapes();
+	test_static();
+	test_object_key();
+	test_parse_cache();
 #endif // 0
 }
 
+static void test_format()
+{
+	test_minify();
+	test_prettify();
+	test_generator();
+}
+
+static void test_extract()
+{
+	test_columnar();
+	test_offset_index();
+	test_record_stream();
+}
+
+#ifdef QUARKSON_BENCH
+#include <chrono>
+
+static volatile double bench_sink;
+
+template <typename F>
+static double bench_ms(int reps, F f)
+{
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < reps; ++i)
+		f();
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / reps;
+}
+
+static void bench_parse_nesting()
+{
+	string deep = string(5000, '[') + string(5000, ']');
+
+	string wide = "[";
+	for (int i = 0; i < 100000; ++i)
+		wide += "{ \"id\": 1, \"tags\": [\"a\", \"b\"], \"pos\": { \"x\": 1.5, \"y\": -2 } },";
+	wide.back() = ']';
+
+	parse_options opts;
+	opts.max_depth = 5000;
+	const std::pair<const char *, const string *> inputs[] = { { "deep", &deep }, { "wide", &wide } };
+	for (const auto &in : inputs)
+	{
+		double it = bench_ms(20, [&] { parser(*in.second, opts).parse_value(); });
+		double rec = bench_ms(20, [&] { parser(*in.second).parse_value_recursive(); });
+		cout << "parse " << in.first << ": iterative " << it << " ms, recursive " << rec << " ms" << endl;
+	}
+}
+
+static void bench_key_lookup()
+{
+	const char *shapes[] = {
+		"{ \"id\": 7, \"ts\": 1700000000, \"user\": \"u1\" }",
+		"{ \"precision\": \"zip\", \"Latitude\": 37.7668, \"Longitude\": -122.3959, \"Address\": \"\", \"City\": \"SAN FRANCISCO\", \"State\": \"CA\", \"Zip\": 94107, \"Country\": \"US\", \"id\": 7, \"ts\": 1700000000, \"user\": \"u1\" }",
+	};
+	for (const char *shape : shapes)
+	{
+		string doc = "[";
+		for (int i = 0; i < 100000; ++i)
+			(doc += shape) += ",";
+		doc.back() = ']';
+		json j = parser::parse(doc);
+		const json::array &records = j.get_array();
+
+		static constexpr json::key id("id"), ts("ts"), user("user"), missing("missing");
+		const string id_s = "id", ts_s = "ts", user_s = "user", missing_s = "missing";
+		double sum = 0;
+		double by_string = bench_ms(10, [&]
+		{
+			for (const auto &r : records)
+			{
+				const json::object &obj = r->get_object();
+				sum += obj.find(id_s)->second->get_number() + obj.find(ts_s)->second->get_number();
+				sum += obj.find(user_s) != obj.end() ? 1 : 0;
+				sum += obj.find(missing_s) != obj.end() ? 1 : 0;
+			}
+		});
+		double by_key = bench_ms(10, [&]
+		{
+			for (const auto &r : records)
+			{
+				const json::object &obj = r->get_object();
+				sum += obj.find(id)->second->get_number() + obj.find(ts)->second->get_number();
+				sum += obj.find(user) != obj.end() ? 1 : 0;
+				sum += obj.find(missing) != obj.end() ? 1 : 0;
+			}
+		});
+		bench_sink = sum;
+		cout << "lookup " << records[0]->get_object().size() << "-member objects: find(string) " << by_string
+			<< " ms, find(key) " << by_key << " ms" << endl;
+	}
+}
+
+static void bench_packed_array()
+{
+	string doc = "[";
+	for (int i = 0; i < 1000000; ++i)
+		(doc += std::to_string(i * 0.25 - 1000)) += ",";
+	doc.back() = ']';
+
+	parse_options boxed;
+	boxed.pack_numbers = false;
+	json packed_j = parser::parse(doc), boxed_j;
+	string err;
+	double parse_packed = bench_ms(5, [&] { packed_j = parser::parse(doc); });
+	double parse_boxed = bench_ms(5, [&] { boxed_j = parser::parse(doc, err, boxed); });
+
+	double sum = 0;
+	double sum_span = bench_ms(20, [&]
+	{
+		for (double num : packed_j.get_numbers())
+			sum += num;
+	});
+	double sum_nodes = bench_ms(20, [&]
+	{
+		for (const auto &v : boxed_j.get_array())
+			sum += v->get_number();
+	});
+	bench_sink = sum;
+	cout << "1M-number array: parse packed " << parse_packed << " ms, boxed " << parse_boxed << " ms; sum span "
+		<< sum_span << " ms, nodes " << sum_nodes << " ms" << endl;
+}
+
+static void bench_projection()
+{
+	string doc = "[";
+	for (int i = 0; i < 2000; ++i)
+	{
+		doc += "{";
+		for (int f = 0; f < 400; ++f)
+			doc += "\"field" + std::to_string(f) + "\": " + (f % 3 == 0 ? "\"some text value\"" : f % 3 == 1 ? "12345.678" : "[1, 2, { \"x\": true }]") + ",";
+		doc.back() = '}';
+		doc += ",";
+	}
+	doc.back() = ']';
+
+	projection four{ "field0", "field100", "field200", "field399" };
+	double full = bench_ms(5, [&] { parser::parse(doc); });
+	double projected = bench_ms(5, [&] { parser::parse(doc, four); });
+	cout << "4 of 400 fields: full parse " << full << " ms, projected " << projected << " ms" << endl;
+}
+
+static void bench_compact()
+{
+	const char *countries[] = { "US", "DE", "FR", "JP" };
+	const char *statuses[] = { "in stock", "backordered", "discontinued" };
+	string doc = "[";
+	for (int i = 0; i < 100000; ++i)
+		doc += string("{ \"sku\": ") + std::to_string(i) + ", \"country\": \"" + countries[i % 4] + "\", \"status\": \"" + statuses[i % 3]
+			+ "\", \"price\": { \"currency\": \"USD\", \"tax\": 0.2 }, \"tags\": [\"retail\", \"catalog\"] },";
+	doc.back() = ']';
+
+	compact_stats stats;
+	double pass = bench_ms(1, [&] { json j = parser::parse(doc); stats = j.compact(); });
+	parse_options opts;
+	opts.dedup = true;
+	string err;
+	double plain = bench_ms(3, [&] { parser::parse(doc); });
+	double dedup = bench_ms(3, [&] { parser::parse(doc, err, opts); });
+	cout << "compact 100k records: " << stats.nodes_shared << " nodes shared, " << stats.bytes_saved / (1024 * 1024) << " MiB saved; parse "
+		<< plain << " ms, parse with dedup " << dedup << " ms, parse + compact " << pass << " ms" << endl;
+}
+
+static void bench_shapes()
+{
+	string doc = "[";
+	for (int i = 0; i < 200000; ++i)
+		doc += "{ \"precision\": \"zip\", \"Latitude\": 37.7668, \"Longitude\": -122.3959, \"Address\": \"\", \"City\": \"SAN FRANCISCO\", \"State\": \"CA\", \"Zip\": " + std::to_string(i) + ", \"Country\": \"US\" },";
+	doc.back() = ']';
+
+	parse_options shaped_opts;
+	shaped_opts.shapes = true;
+	string err;
+	json plain, shaped;
+	double parse_plain = bench_ms(3, [&] { plain = parser::parse(doc); });
+	double parse_shaped = bench_ms(3, [&] { shaped = parser::parse(doc, err, shaped_opts); });
+
+	static constexpr json::key zip("Zip"), city("City"), missing("missing");
+	auto lookups = [&](const json &j)
+	{
+		double sum = 0;
+		for (const auto &r : j.get_array())
+			sum += r->find(zip)->get_number() + r->find(city)->get_string().size() + (r->find(missing) ? 1 : 0);
+		bench_sink = sum;
+	};
+	double find_plain = bench_ms(10, [&] { lookups(plain); });
+	double find_shaped = bench_ms(10, [&] { lookups(shaped); });
+	cout << "200k 8-member records: parse " << parse_plain << " ms, with shapes " << parse_shaped << " ms; 3 finds per record "
+		<< find_plain << " ms, shaped " << find_shaped << " ms" << endl;
+}
+
+static void bench_generator()
+{
+	string doc = "[";
+	for (int i = 0; i < 400000; ++i)
+		doc += "{ \"precision\": \"zip\", \"Latitude\": 37.7668, \"Longitude\": -122.3959, \"City\": \"SAN FRANCISCO\", \"Zip\": " + std::to_string(i) + ", \"IDs\": [116, 943, 234, 38793] },";
+	doc.back() = ']';
+	json j = parser::parse(doc);
+
+	string out;
+	double serial = bench_ms(3, [&] { generator::generate(j, out); });
+	cout << "generate " << out.size() / (1 << 20) << " MiB: 1 thread " << serial << " ms";
+	for (unsigned threads = 2; threads <= std::max(4u, std::thread::hardware_concurrency()); threads *= 2)
+		cout << ", " << threads << " threads " << bench_ms(3, [&] { generator::generate(j, out, threads); }) << " ms";
+	cout << endl;
+}
+
+static void bench_parse_cache()
+{
+	string doc = "{ \"flags\": [";
+	for (int i = 0; i < 500; ++i)
+		doc += "{ \"name\": \"feature_" + std::to_string(i) + "\", \"enabled\": true, \"rollout\": 0.25, \"segments\": [\"beta\", \"internal\"] },";
+	doc.back() = ']';
+	doc += " }";
+
+	parse_cache cache(64 << 20);
+	double plain = bench_ms(1, [&] { for (int i = 0; i < 200; ++i) bench_sink = parser::parse(doc).get_object().size(); });
+	double cached = bench_ms(1, [&] { for (int i = 0; i < 200; ++i) bench_sink = cache.parse(doc).get_object().size(); });
+	cout << "200 parses of the same " << doc.size() / 1024 << " KiB: " << plain << " ms, cached " << cached << " ms ("
+		<< cache.stats().hits << " hits)" << endl;
+}
+
+static void bench_record_stream()
+{
+	string doc = "[";
+	for (int i = 0; i < 200000; ++i)
+		doc += "{ \"ts\": " + std::to_string(1700000000 + i) + ", \"level\": \"info\", \"msg\": \"request served\", \"ms\": 12.5, \"tags\": [\"api\", \"v2\"] },\n";
+	doc.resize(doc.size() - 2);
+	doc += "]";
+	const string path = "quarkson_bench_stream.json.gz";
+	stream_options opts;
+	size_t count = 0;
+	auto counter = [&](json &&) { ++count; return true; };
+	string err;
+#ifdef QUARKSON_HAS_ZLIB
+	write_file(path, gzip(doc));
+	// What callers do today: all of the text first, then one parse.
+	double whole = bench_ms(3, [&]
+	{
+		gzFile f = gzopen(path.c_str(), "rb");
+		string text;
+		char buf[1 << 16];
+		for (int n; (n = gzread(f, buf, sizeof(buf))) > 0; )
+			text.append(buf, n);
+		gzclose(f);
+		bench_sink = static_cast<double>(parser::parse(text).get_array().size());
+	});
+	cout << "gzip ";
+#else
+	write_file(path, doc);
+	double whole = bench_ms(3, [&] { bench_sink = static_cast<double>(parser::parse(doc).get_array().size()); });
+#endif
+	double streamed = bench_ms(3, [&] { record_stream::parse_file(path, counter, err, opts); });
+	cout << "200k records, " << doc.size() / (1 << 20) << " MiB of text: whole " << whole << " ms, streamed " << streamed
+		<< " ms holding " << opts.block_size * (opts.queue_blocks + 3) / 1024 << " KiB of text" << endl;
+	std::remove(path.c_str());
+}
+
+static void bench()
+{
+	bench_parse_nesting();
+	bench_key_lookup();
+	bench_packed_array();
+	bench_projection();
+	bench_compact();
+	bench_shapes();
+	bench_generator();
+	bench_parse_cache();
+	bench_record_stream();
+}
+#endif
+
 int main()
 {
 	test_parse();
+	test_format();
+	test_extract();
+#ifdef QUARKSON_BENCH
+	bench();
+#endif
 
 	std::cout << test_pass << "/" << test_count << " (" << std::setprecision(3) << test_pass * 100.0 / test_count << ") passed" << std::endl;
 	system("PAUSE");